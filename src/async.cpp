@@ -0,0 +1,255 @@
+#include <iostream>
+#include <thread>
+#include <algorithm>
+
+#include "async.h"
+#include "trace.h"
+
+using namespace std;
+
+#define EPSILON 0.00001f
+
+/** Maximum number of epochs, as the iterations of doFastWaterTransfer */
+#define MAX_EPOCHS 10000
+
+//-----------------------------------------------------------------
+
+AsyncWaterTransfer::AsyncWaterTransfer(int numThreads) : numThreads(max(numThreads, 1)), grid(0), cells(0)
+{
+}
+
+//-----------------------------------------------------------------
+
+int AsyncWaterTransfer::run(Grid &grid, HEIGHT minTransfer, bool verbose)
+{
+	this->grid = &grid;
+	this->minTransfer = minTransfer;
+	this->verbose = verbose;
+	cells = grid.getCell(0, 0);
+	size_t numCells = (size_t)grid.getDimX() * grid.getDimY();
+
+	locks.reset(new atomic_flag[numCells]);
+	queued.reset(new atomic<bool>[numCells]);
+	for (size_t i = 0; i < numCells; ++i) {
+		locks[i].clear();
+		queued[i] = false;
+	}
+	queues.clear();
+	for (int t = 0; t < numThreads; ++t)
+		queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+
+	// Each worker starts with a contiguous block of land cells, which are the first epoch
+	size_t numLandCells = grid.getNumLandCells(), n = 0;
+	numPending = 0;
+	for (size_t i = 0; i < numCells; ++i)
+		if (cells[i].getZ() > 0.0f)
+			push((int)(n++ * numThreads / max(numLandCells, (size_t)1)), cells + i, 0);
+
+	stop = false;
+	EpochCounters first = { 0, numPending, 0, 0, 0.0 };
+	epochs.assign(1, first);
+	numEpochs = 0;
+	numProcessed = numStolen = 0;
+	if (verbose)
+		cout << "Epoch: ";
+
+	vector<thread> workers;
+	for (int t = 1; t < numThreads; ++t)
+		workers.push_back(thread(&AsyncWaterTransfer::work, this, t));
+	work(0);
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+
+	grid.invalidateStats();
+	locks.reset();
+	queued.reset();
+	queues.clear();
+	epochs.clear();
+	return numEpochs + 1;
+}
+
+//-----------------------------------------------------------------
+
+bool AsyncWaterTransfer::push(int thread, Cell *cell, int epoch)
+{
+	if (queued[cell - cells].exchange(true))
+		return false;
+	++numPending;
+	QueuedCell queuedCell = { cell, epoch };
+	WorkQueue &queue = *queues[thread];
+	lock_guard<mutex> guard(queue.mutex);
+	queue.cells.push_back(queuedCell);
+	return true;
+}
+
+//-----------------------------------------------------------------
+
+bool AsyncWaterTransfer::pop(int thread, QueuedCell &cell, unsigned long long &stolen)
+{
+	{
+		WorkQueue &queue = *queues[thread];
+		lock_guard<mutex> guard(queue.mutex);
+		if (!queue.cells.empty()) {
+			cell = queue.cells.front();
+			queue.cells.pop_front();
+			return true;
+		}
+	}
+	for (int k = 1; k < numThreads; ++k) {
+		WorkQueue &queue = *queues[(thread + k) % numThreads];
+		lock_guard<mutex> guard(queue.mutex);
+		if (!queue.cells.empty()) {
+			cell = queue.cells.back();
+			queue.cells.pop_back();
+			++stolen;
+			return true;
+		}
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------
+
+void AsyncWaterTransfer::flush(vector<EpochCounters> &counters)
+{
+	lock_guard<mutex> guard(epochMutex);
+	for (size_t k = 0; k < counters.size(); ++k) {
+		const EpochCounters &local = counters[k];
+		numProcessed += local.processed;
+		// The epochs before the current one have ended, so they have no cells
+		size_t e = (size_t)(local.epoch - numEpochs);
+		while (epochs.size() < e + 2) {
+			EpochCounters next = { numEpochs + (int)epochs.size(), 0, 0, 0, 0.0 };
+			epochs.push_back(next);
+		}
+		epochs[e].processed += local.processed;
+		epochs[e].transfer += local.transfer;
+		epochs[e + 1].queued += local.children;
+	}
+	counters.clear();
+
+	// The cells of an epoch are all queued once the previous one has ended
+	while (!stop && !epochs.empty() && epochs.front().processed == epochs.front().queued) {
+		if (epochs.front().queued == 0) {
+			// No cell reached this epoch, so no later epoch has cells either
+			epochs.clear();
+			break;
+		}
+		++numEpochs;
+		if (epochs.front().transfer <= minTransfer || numEpochs >= MAX_EPOCHS - 1)
+			stop = true;
+		if (verbose && !(numEpochs % 10)) {
+			cout << numEpochs << " (" << epochs.front().transfer << ") ";
+			cout.flush();
+		}
+		epochs.pop_front();
+	}
+}
+
+//-----------------------------------------------------------------
+
+void AsyncWaterTransfer::lockNeighbourhood(Cell *cell)
+{
+	size_t i = (size_t)(cell - cells), x = i % grid->getDimX(), y = i / grid->getDimX();
+	if (x == 0 || y == 0 || x == grid->getDimX() - 1 || y == grid->getDimY() - 1) {
+		lock(cell);
+		return;
+	}
+	// Rows and columns in increasing order give the memory order of the 9 cells
+	for (int r = -1; r <= 1; ++r)
+		for (int c = -1; c <= 1; ++c)
+			lock(cell + (ptrdiff_t)r * grid->getDimX() + c);
+}
+
+//-----------------------------------------------------------------
+
+void AsyncWaterTransfer::unlockNeighbourhood(Cell *cell)
+{
+	size_t i = (size_t)(cell - cells), x = i % grid->getDimX(), y = i / grid->getDimX();
+	if (x == 0 || y == 0 || x == grid->getDimX() - 1 || y == grid->getDimY() - 1) {
+		unlock(cell);
+		return;
+	}
+	for (int r = -1; r <= 1; ++r)
+		for (int c = -1; c <= 1; ++c)
+			unlock(cell + (ptrdiff_t)r * grid->getDimX() + c);
+}
+
+//-----------------------------------------------------------------
+
+void AsyncWaterTransfer::work(int thread)
+{
+	// Counters of the epochs of the cells processed since the last flush
+	vector<EpochCounters> counters;
+	counters.reserve(ASYNC_LOCAL_EPOCHS);
+	size_t numLocal = 0;
+	unsigned long long stolen = 0;
+	QueuedCell queuedCell;
+	Trace::nameThread("async worker");
+	TraceSpan span("async work");
+
+	while (!stop) {
+		if (!pop(thread, queuedCell, stolen)) {
+			// The counters of an idle worker may be the last ones of an epoch
+			if (numLocal) {
+				flush(counters);
+				numLocal = 0;
+			}
+			// Cells being processed by other workers may still send water
+			if (numPending == 0)
+				break;
+			this_thread::yield();
+			continue;
+		}
+		Cell *cell = queuedCell.cell;
+		queued[cell - cells] = false;
+
+		size_t k = 0;
+		while (k < counters.size() && counters[k].epoch != queuedCell.epoch)
+			++k;
+		if (k == counters.size()) {
+			if (counters.size() == ASYNC_LOCAL_EPOCHS) {
+				flush(counters);
+				numLocal = 0;
+				k = 0;
+			}
+			EpochCounters local = { queuedCell.epoch, 0, 0, 0, 0.0 };
+			counters.push_back(local);
+		}
+		EpochCounters &local = counters[k];
+
+		lockNeighbourhood(cell);
+		Cell *lowerCell = grid->getLowerNeighbourCell(cell);
+		HEIGHT movingWater = lowerCell ? min(cell->getW(), 0.5f * (cell->getZW() - lowerCell->getZW())) : cell->getW();
+		bool receiverQueued = false;
+		if (movingWater > EPSILON) {
+			cell->addW(-movingWater);
+			if (lowerCell && lowerCell->getZ() > 0.0f) {
+				lowerCell->addW(+movingWater);
+				receiverQueued = true;
+			}
+			local.transfer += movingWater;
+		}
+		bool hasWater = cell->getW() > EPSILON;
+		unlockNeighbourhood(cell);
+
+		// The children are flushed with the cell, so the next epoch has all its cells once this one ends
+		if (receiverQueued && push(thread, lowerCell, queuedCell.epoch + 1))
+			++local.children;
+		if (hasWater && push(thread, cell, queuedCell.epoch + 1))
+			++local.children;
+		++local.processed;
+		--numPending;
+
+		if (++numLocal == ASYNC_FLUSH_CELLS) {
+			flush(counters);
+			numLocal = 0;
+		}
+	}
+	flush(counters);
+
+	lock_guard<mutex> guard(epochMutex);
+	numStolen += stolen;
+}
+
+//-----------------------------------------------------------------
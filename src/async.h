@@ -0,0 +1,143 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "grid.h"
+
+/** Number of cells a worker processes before adding its counters to the epochs */
+#define ASYNC_FLUSH_CELLS 256
+
+/** Number of epochs a worker counts before adding its counters to the epochs */
+#define ASYNC_LOCAL_EPOCHS 8
+
+/** This class computes the drainage with the transfer rule of Grid::fastWaterTransfer, but without
+the iteration barrier of the FIFO. Each worker thread processes the cells of its own queue and steals
+cells from the other queues when it runs out of them. Processing a cell locks it and its 8 neighbours
+(per-cell spinlocks, taken in memory order), so the steepest descent neighbour is chosen and the water
+transferred without any other worker writing those cells.
+
+Convergence is measured in epochs, which replace the iterations. The land cells are the first epoch,
+and a cell queued while processing a cell of epoch e belongs to epoch e + 1, as the cells queued during
+an iteration of doFastWaterTransfer are processed in the next one. A worker may run ahead through the
+epochs of its own cells, but an epoch only ends when the previous one has ended and all its cells have
+been processed, whichever worker holds them. The run stops after the first epoch that transfers no
+more than the minimum */
+class AsyncWaterTransfer {
+
+public:
+	/** Constructor */
+	AsyncWaterTransfer(int numThreads);
+
+	/** Runs the workers until an epoch transfers no more than minTransfer or no cell has water to
+	transfer. The W and DA values of the grid must be initialized.
+	\return The number of epochs, comparable to the number of iterations of doFastWaterTransfer */
+	int run(Grid &grid, HEIGHT minTransfer, bool verbose);
+
+	/** Gets the number of cells processed by the last run */
+	inline unsigned long long getNumProcessed() { return numProcessed; }
+
+	/** Gets the number of cells stolen from other workers by the last run */
+	inline unsigned long long getNumStolen() { return numStolen; }
+
+private:
+	/** Cell waiting in a queue and its epoch */
+	struct QueuedCell {
+		Cell *cell;
+		int epoch;
+	};
+
+	/** Counters of an epoch */
+	struct EpochCounters {
+		int epoch;
+		/** Cells of the epoch (queued) and cells of the next epoch queued by them (children) */
+		unsigned long long queued, processed, children;
+		double transfer;
+	};
+
+	/** Queue of a worker. The owner takes cells from the front and the thieves from the back */
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<QueuedCell> cells;
+	};
+
+	int numThreads;
+	Grid *grid;
+	/** First cell of the grid, used to index the flags */
+	Cell *cells;
+	/** Spinlock of each cell */
+	std::unique_ptr<std::atomic_flag[]> locks;
+	/** Whether each cell is waiting in a queue */
+	std::unique_ptr<std::atomic<bool>[]> queued;
+	std::vector< std::unique_ptr<WorkQueue> > queues;
+	/** Cells waiting in a queue or being processed */
+	std::atomic<size_t> numPending;
+	std::atomic<bool> stop;
+
+	/** Counters of the epochs not ended yet, from the current one, protected by epochMutex */
+	std::mutex epochMutex;
+	std::deque<EpochCounters> epochs;
+	HEIGHT minTransfer;
+	int numEpochs;
+	unsigned long long numProcessed, numStolen;
+	bool verbose;
+
+	/** Body of a worker thread */
+	void work(int thread);
+
+	/** Inserts a cell in the queue of a worker if it is not already waiting.
+	\return Whether the cell was inserted */
+	bool push(int thread, Cell *cell, int epoch);
+
+	/** Gets a cell from the queue of a worker or, if it is empty, from another queue */
+	bool pop(int thread, QueuedCell &cell, unsigned long long &stolen);
+
+	/** Adds the counters of a worker to the epochs, ends the epochs whose cells have all been
+	processed and decides whether to stop. The counters of the worker are cleared */
+	void flush(std::vector<EpochCounters> &counters);
+
+	/** Locks a cell and, if it is not a border cell, its 8 neighbours */
+	void lockNeighbourhood(Cell *cell);
+
+	/** Unlocks the cells locked by lockNeighbourhood */
+	void unlockNeighbourhood(Cell *cell);
+
+	inline void lock(Cell *cell) {
+		std::atomic_flag &flag = locks[cell - cells];
+		while (flag.test_and_set(std::memory_order_acquire))
+			std::this_thread::yield();
+	}
+
+	inline void unlock(Cell *cell) {
+		locks[cell - cells].clear(std::memory_order_release);
+	}
+};
+
+#endif
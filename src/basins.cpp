@@ -0,0 +1,118 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#include "basins.h"
+
+using namespace std;
+
+/** Size of the buffer of the output streams */
+#define BASINS_BUFFER_SIZE (1 << 20)
+
+//-----------------------------------------------------------------
+
+void Basins::label(Grid &grid)
+{
+	dimX = grid.getDimX();
+	dimY = grid.getDimY();
+	cellDimX = grid.getCellDimX();
+	cellDimY = grid.getCellDimY();
+	basins.clear();
+
+	ptrdiff_t numCells = (ptrdiff_t)dimX * dimY;
+	vector<size_t> next(numCells), root(numCells);
+
+	// Each land cell points to its downstream land cell; outlets and sinks point to themselves.
+	// Water reaching the sea leaves the grid, so sea cells are outlets too
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t i = 0; i < numCells; ++i) {
+		Cell *downCell = grid.getDownstreamCell((unsigned)(i % dimX), (unsigned)(i / dimX));
+		root[i] = downCell && downCell->getZ() > 0.0f ? grid.getCellIndex(downCell) : (size_t)i;
+	}
+
+	// Pointer jumping: after k passes each cell points 2^k cells downstream
+	int numChanged = 1;
+	while (numChanged) {
+		numChanged = 0;
+		#pragma omp parallel for schedule(static) reduction(+:numChanged)
+		for (ptrdiff_t i = 0; i < numCells; ++i) {
+			next[i] = root[root[i]];
+			if (next[i] != root[i])
+				++numChanged;
+		}
+		root.swap(next);
+	}
+
+	// Number the basins by their outlets, reusing next to store the label of each outlet
+	for (ptrdiff_t i = 0; i < numCells; ++i) {
+		unsigned x = (unsigned)(i % dimX), y = (unsigned)(i / dimX);
+		if (root[i] == (size_t)i && grid.getCell(x, y)->getZ() > 0.0f) {
+			Basin basin;
+			basin.outletX = x;
+			basin.outletY = y;
+			if (x == 0 || y == 0 || x == dimX - 1 || y == dimY - 1)
+				basin.outletType = Basin::BORDER;
+			else if (grid.getDownstreamCell(x, y))
+				basin.outletType = Basin::SEA;
+			else
+				basin.outletType = Basin::SINK;
+			basin.numCells = 0;
+			basin.maxDA = 0.0f;
+			basins.push_back(basin);
+			next[i] = basins.size();
+		}
+		else
+			next[i] = NO_BASIN;
+	}
+
+	// Label the cells and compute the statistics of the basins
+	labels.resize(numCells);
+	for (ptrdiff_t i = 0; i < numCells; ++i) {
+		Cell *cell = grid.getCell((unsigned)(i % dimX), (unsigned)(i / dimX));
+		labels[i] = cell->getZ() > 0.0f ? (unsigned)next[root[i]] : NO_BASIN;
+		if (labels[i] != NO_BASIN) {
+			Basin &basin = basins[labels[i] - 1];
+			++basin.numCells;
+			basin.maxDA = max(basin.maxDA, cell->getDA());
+		}
+	}
+}
+
+//-----------------------------------------------------------------
+
+void Basins::saveLabels(const char *filename)
+{
+	vector<char> buffer(BASINS_BUFFER_SIZE);
+	ofstream ofs;
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	ofs.open(filename, ofstream::binary);
+
+	unsigned header[3] = { 1, dimX, dimY };
+	ofs.write("BSNL", 4);
+	ofs.write((const char *)header, sizeof(header));
+	ofs.write((const char *)&labels[0], labels.size() * sizeof(unsigned));
+}
+
+//-----------------------------------------------------------------
+
+void Basins::saveTable(const char *filename)
+{
+	vector<char> buffer(BASINS_BUFFER_SIZE);
+	ofstream ofs;
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	ofs.open(filename);
+
+	static const char *outletTypes[] = { "border", "sea", "sink" };
+
+	ofs << "basin,outletX,outletY,outletType,cells,areaKm2,maxDA" << endl;
+	for (size_t b = 0; b < basins.size(); ++b) {
+		const Basin &basin = basins[b];
+		ofs << b + 1 << "," << basin.outletX << "," << basin.outletY << "," << outletTypes[basin.outletType] << ","
+			<< basin.numCells << "," << basin.numCells * (double)cellDimX * cellDimY / 1.0e6 << ","
+			<< basin.maxDA << "\n";
+	}
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,74 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef BASINS_H
+#define BASINS_H
+
+#include <vector>
+#include "grid.h"
+
+/** Statistics of a drainage basin */
+struct Basin {
+	enum OutletType { BORDER = 0, SEA = 1, SINK = 2 };
+
+	/** Position of the outlet cell */
+	unsigned outletX, outletY;
+	/** Where the water leaves the basin */
+	unsigned outletType;
+	/** Number of cells of the basin */
+	size_t numCells;
+	/** Maximum DA value of the basin */
+	HEIGHT maxDA;
+};
+
+/** This class labels each land cell of a grid with the basin it drains to, following
+the steepest descent neighbours of Grid::getDownstreamCell */
+class Basins {
+
+public:
+	/** Label of the cells that do not belong to any basin (sea) */
+	static const unsigned NO_BASIN = 0;
+
+	/** Labels the cells of the grid. Basins are numbered from 1 in the raster order of their outlets */
+	void label(Grid &grid);
+
+	/** Saves the label raster: "BSNL", version, dimX, dimY and a 32 bit (little-endian) label per cell in raster order */
+	void saveLabels(const char *filename);
+
+	/** Saves the per-basin table in CSV format */
+	void saveTable(const char *filename);
+
+	/** Gets the number of basins */
+	inline size_t getNumBasins() { return basins.size(); }
+
+private:
+	/** Grid dimentions */
+	unsigned dimX, dimY;
+	/** Cell dimentions */
+	unsigned cellDimX, cellDimY;
+	/** Basin label of each cell */
+	std::vector<unsigned> labels;
+	/** Basins; basin i is stored at position i - 1 */
+	std::vector<Basin> basins;
+};
+
+#endif
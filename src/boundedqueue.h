@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/** This class implements a blocking FIFO with a maximum size, used to connect threads */
+template<typename T>
+class BoundedQueue {
+	std::deque<T> storage;
+	size_t maxSize;
+	bool closed;
+	std::mutex mutex;
+	std::condition_variable notFull, notEmpty;
+
+public:
+	/** Constructor */
+	BoundedQueue(size_t maxSize = 1) : maxSize(maxSize), closed(false) {}
+
+	/** Inserts an element. Blocks while the queue is full */
+	void push(const T &t) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (storage.size() >= maxSize)
+			notFull.wait(lock);
+		storage.push_back(t);
+		notEmpty.notify_one();
+	}
+
+	/** Extracts an element. Blocks while the queue is empty.
+	Returns false if the queue is empty and closed */
+	bool pop(T &t) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (storage.empty() && !closed)
+			notEmpty.wait(lock);
+		if (storage.empty())
+			return false;
+		t = storage.front();
+		storage.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	/** Extracts an element if there is one, without blocking */
+	bool tryPop(T &t) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (storage.empty())
+			return false;
+		t = storage.front();
+		storage.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	/** Closes the queue: no more elements will be inserted */
+	void close() {
+		std::unique_lock<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+};
+
+#endif
@@ -34,10 +34,10 @@
 #include <vector>
 
 /** This class implements a static circular queue */
-template<typename T>
+template<typename T, typename Alloc = std::allocator<T> >
 class CircQueue {
-	std::vector<T> storage;
-	typename std::vector<T>::iterator first, last;
+	std::vector<T, Alloc> storage;
+	typename std::vector<T, Alloc>::iterator first, last;
 
 public:
 	/** Constructor */
@@ -68,6 +68,11 @@ public:
 		return *first;
 	}
 
+	/** Get the last inserted element */
+	T &back() {
+		return last == storage.begin() ? storage.back() : *(last - 1);
+	}
+
 	/**Clear all the elements of the queue.*/
 	void clear() {
 		storage.clear();
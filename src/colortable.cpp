@@ -0,0 +1,68 @@
+#include <cmath>
+
+#include "colortable.h"
+
+//-----------------------------------------------------------------
+
+static double log10Value( double value, double maxValue )
+{
+	// Input will be between minValue and maxValue
+	double minValue = 0;
+
+	//output will be between minv and maxv
+	double minv = log10(1.0);
+	double maxv = log10(maxValue);
+
+	// Adjustment factor
+	double scale = (maxv - minv) / (maxValue - minValue);
+	return pow(10.0, minv + (scale * (value - minValue)));
+}
+
+static void computeColor(int &r, int &g, int &b, double value, double maxValue)
+{
+	value = maxValue - value/* - 1.0*/;
+	double valueLog = log10Value( value, maxValue );
+	r = 0;
+	//from 255 (min) to 0 (max)
+	g = 255 * valueLog / maxValue;
+	b = 255;
+	return;
+}
+
+//-----------------------------------------------------------------
+
+ColorTable::ColorTable()
+{
+	int r, g, b;
+	Cell cell;
+
+	for (int i = 0; i <= HEIGHT_TABLE_MAX + 1; ++i) {
+		cell.setZ(i == 0 ? 0.0f : i - 0.5f);
+		cell.getHeightColor(r, g, b);
+		heights[i] = pack(r, g, b);
+	}
+
+	setupRamp(0.0f);
+}
+
+//-----------------------------------------------------------------
+
+void ColorTable::setupRamp(HEIGHT maxValue)
+{
+	int r, g, b;
+
+	if (maxValue <= 0.0f) {
+		for (int i = 0; i < RAMP_SIZE; ++i)
+			ramp[i] = pack(0, 0, 255);
+		rampScale = 0.0f;
+		return;
+	}
+
+	rampScale = (RAMP_SIZE - 1) / maxValue;
+	for (int i = 0; i < RAMP_SIZE; ++i) {
+		computeColor(r, g, b, (double)maxValue * i / (RAMP_SIZE - 1), maxValue);
+		ramp[i] = pack(r, g, b);
+	}
+}
+
+//-----------------------------------------------------------------
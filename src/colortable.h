@@ -0,0 +1,82 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef COLORTABLE_H
+#define COLORTABLE_H
+
+#include "cell.h"
+
+/** Number of entries of the logarithmic colour ramp */
+#define RAMP_SIZE 4096
+
+/** Maximum altitude with its own entry in the height colour table */
+#define HEIGHT_TABLE_MAX 3000
+
+/** Precomputed colour tables used by the output writers. Colours are packed
+as 0xAARRGGBB, the layout of QImage::Format_RGB32 */
+class ColorTable {
+
+public:
+	/** Constructor. Builds the height colour table */
+	ColorTable();
+
+	/** Quantizes the logarithmic ramp used for DA and W values between 0 and maxValue */
+	void setupRamp(HEIGHT maxValue);
+
+	/** Returns the colour of the logarithmic ramp for a value between 0 and maxValue */
+	inline unsigned getRampColor(HEIGHT value) {
+		int i = (int)(value * rampScale + 0.5f);
+		if (i < 0) i = 0;
+		if (i > RAMP_SIZE - 1) i = RAMP_SIZE - 1;
+		return ramp[i];
+	}
+
+	/** Returns the colour of a cell according to its altitude Z (see Cell::getHeightColor) */
+	inline unsigned getHeightColor(HEIGHT Z) {
+		if (Z <= 0)
+			return heights[0];
+		int i = (int)Z;
+		return heights[i < HEIGHT_TABLE_MAX ? i + 1 : HEIGHT_TABLE_MAX + 1];
+	}
+
+	/** Packs a colour */
+	static inline unsigned pack(int r, int g, int b) {
+		return 0xff000000u | ((r & 0xff) << 16) | ((g & 0xff) << 8) | (b & 0xff);
+	}
+
+	/** Unpacks a colour */
+	static inline void unpack(unsigned color, int &r, int &g, int &b) {
+		r = (color >> 16) & 0xff;
+		g = (color >> 8) & 0xff;
+		b = color & 0xff;
+	}
+
+private:
+	/** Logarithmic ramp */
+	unsigned ramp[RAMP_SIZE];
+	/** Factor that maps a value to its ramp entry */
+	HEIGHT rampScale;
+	/** Height colours. First entry is used for sea level; entry i+1 for altitudes in [i, i+1) */
+	unsigned heights[HEIGHT_TABLE_MAX + 2];
+};
+
+#endif
@@ -0,0 +1,246 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+#ifndef _WIN32
+	#include <cstring>
+	#include <cstdio>
+	#include <cerrno>
+	#include <csignal>
+	#include <pthread.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/wait.h>
+#endif
+
+#include "domain.h"
+
+using namespace std;
+
+#define MAX_ITERATIONS 10000
+
+//-----------------------------------------------------------------
+
+DomainDecomposition::DomainDecomposition(int numProcesses) : numProcesses(max(numProcesses, 1))
+{
+}
+
+//-----------------------------------------------------------------
+
+#ifdef _WIN32
+
+int DomainDecomposition::run(Grid &, HEIGHT, bool)
+{
+	throw runtime_error("multi-process runs are not supported on this platform");
+}
+
+#else
+
+/** Control block at the beginning of the shared segment */
+struct SharedHeader {
+	/** Barrier of the worker processes */
+	pthread_barrier_t barrier;
+	/** Water transferred by each band in the last iteration */
+	double transfer[MAX_PROCESSES];
+	/** Cells queued in each band after the last exchange */
+	unsigned long long queuedCells[MAX_PROCESSES];
+	/** Number of iterations */
+	int numIter;
+};
+
+/** Shared segment: the header followed by, for each process, the water sent to the row above
+and to the row below the band and the W values of the first and last rows of the band (dimX
+values each), and then the W and DA planes of the whole grid */
+struct SharedSegment {
+	SharedHeader *header;
+	HEIGHT *outflow, *edges, *W, *DA;
+	void *address;
+	size_t size;
+
+	SharedSegment(unsigned dimX, unsigned dimY, int numProcesses) {
+		size_t rowBytes = (size_t)dimX * sizeof(HEIGHT);
+		size_t headerBytes = (sizeof(SharedHeader) + 63) / 64 * 64;
+		size = headerBytes + 4 * numProcesses * rowBytes + 2 * (size_t)dimY * rowBytes;
+
+		// The name is removed at once: the workers inherit the mapping
+		char name[64];
+		snprintf(name, sizeof(name), "/drainage_flood_%d", (int)getpid());
+		int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+			throw runtime_error(string("shm_open: ") + strerror(errno));
+		shm_unlink(name);
+		if (ftruncate(fd, size) != 0) {
+			close(fd);
+			throw runtime_error(string("ftruncate: ") + strerror(errno));
+		}
+		address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (address == MAP_FAILED)
+			throw runtime_error(string("mmap: ") + strerror(errno));
+
+		header = (SharedHeader *)address;
+		outflow = (HEIGHT *)((char *)address + headerBytes);
+		edges = outflow + 2 * (size_t)numProcesses * dimX;
+		W = edges + 2 * (size_t)numProcesses * dimX;
+		DA = W + (size_t)dimX * dimY;
+	}
+
+	~SharedSegment() {
+		munmap(address, size);
+	}
+};
+
+//-----------------------------------------------------------------
+
+/** Body of a worker process: iterates over the band of process p and stores its W and DA in the segment */
+static void runBand(Grid &grid, SharedSegment &shared, int p, int numProcesses, HEIGHT minTransfer, bool verbose)
+{
+	unsigned dimX = grid.getDimX(), dimY = grid.getDimY();
+	unsigned firstRow = (unsigned)((size_t)dimY * p / numProcesses);
+	unsigned endRow = (unsigned)((size_t)dimY * (p + 1) / numProcesses);
+	HEIGHT *outflow = shared.outflow + 2 * (size_t)p * dimX, *edges = shared.edges + 2 * (size_t)p * dimX;
+	SharedHeader *header = shared.header;
+
+	grid.setBand(firstRow, endRow);
+	grid.setupFastWaterTransfer();
+
+	double transfer = +INFINITY;
+	unsigned long long queuedCells = 1;
+	int n = 1;
+	if (verbose && p == 0)
+		cout << "Iteration: ";
+
+	while (transfer > minTransfer && n < MAX_ITERATIONS && queuedCells > 0) {
+		HEIGHT bandTransfer = grid.fastWaterTransfer();
+
+		// Water sent to the halo rows
+		memcpy(outflow, grid.getBandOutflow(), 2 * dimX * sizeof(HEIGHT));
+		grid.clearBandOutflow();
+		pthread_barrier_wait(&header->barrier);
+
+		// Water received from the neighbour bands, and the edge rows after receiving it
+		if (p > 0)
+			grid.receiveBandInflow(firstRow, shared.outflow + (2 * (size_t)(p - 1) + 1) * dimX);
+		if (p < numProcesses - 1)
+			grid.receiveBandInflow(endRow - 1, shared.outflow + 2 * (size_t)(p + 1) * dimX);
+		header->transfer[p] = bandTransfer;
+		header->queuedCells[p] = grid.getNumQueuedCells();
+		for (unsigned int c = 0; c < dimX; ++c) {
+			edges[c] = grid.getCell(c, firstRow)->getW();
+			edges[dimX + c] = grid.getCell(c, endRow - 1)->getW();
+		}
+		pthread_barrier_wait(&header->barrier);
+
+		// Halo rows and stopping rule, computed in the same order by all the processes
+		if (p > 0) {
+			const HEIGHT *upper = shared.edges + (2 * (size_t)(p - 1) + 1) * dimX;
+			for (unsigned int c = 0; c < dimX; ++c)
+				grid.getCell(c, firstRow - 1)->setW(upper[c]);
+		}
+		if (p < numProcesses - 1) {
+			const HEIGHT *lower = shared.edges + 2 * (size_t)(p + 1) * dimX;
+			for (unsigned int c = 0; c < dimX; ++c)
+				grid.getCell(c, endRow)->setW(lower[c]);
+		}
+		transfer = 0.0;
+		queuedCells = 0;
+		for (int i = 0; i < numProcesses; ++i) {
+			transfer += header->transfer[i];
+			queuedCells += header->queuedCells[i];
+		}
+
+		if (!(n % 10) && verbose && p == 0) {
+			cout << n << " (" << transfer << ") ";
+			cout.flush();
+		}
+		++n;
+	}
+
+	for (unsigned int r = firstRow; r < endRow; ++r) {
+		for (unsigned int c = 0; c < dimX; ++c) {
+			Cell *cell = grid.getCell(c, r);
+			shared.W[(size_t)r * dimX + c] = cell->getW();
+			shared.DA[(size_t)r * dimX + c] = cell->getDA();
+		}
+	}
+	if (p == 0)
+		header->numIter = n;
+}
+
+//-----------------------------------------------------------------
+
+int DomainDecomposition::run(Grid &grid, HEIGHT minTransfer, bool verbose)
+{
+	unsigned dimX = grid.getDimX(), dimY = grid.getDimY();
+	int numWorkers = min(numProcesses, min((int)dimY, MAX_PROCESSES));
+	SharedSegment shared(dimX, dimY, numWorkers);
+
+	pthread_barrierattr_t attributes;
+	pthread_barrierattr_init(&attributes);
+	pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&shared.header->barrier, &attributes, numWorkers);
+	pthread_barrierattr_destroy(&attributes);
+
+	// Buffered output would be written again by every worker
+	cout.flush();
+
+	vector<pid_t> workers;
+	for (int p = 0; p < numWorkers; ++p) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			int status = 0;
+			try {
+				runBand(grid, shared, p, numWorkers, minTransfer, verbose);
+			} catch(std::exception &e) {
+				cerr << "Worker " << p << ": " << e.what() << endl;
+				status = 1;
+			}
+			cout.flush();
+			_exit(status);
+		}
+		if (pid < 0)
+			break;
+		workers.push_back(pid);
+	}
+
+	// A failed worker would block the others at the barrier, so they are stopped
+	bool failed = (int)workers.size() < numWorkers;
+	size_t running = workers.size();
+	if (failed)
+		for (size_t i = 0; i < workers.size(); ++i)
+			kill(workers[i], SIGKILL);
+	while (running > 0) {
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0)
+			break;
+		if (find(workers.begin(), workers.end(), pid) == workers.end())
+			continue;
+		--running;
+		if (!failed && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+			failed = true;
+			for (size_t i = 0; i < workers.size(); ++i)
+				kill(workers[i], SIGKILL);
+		}
+	}
+	pthread_barrier_destroy(&shared.header->barrier);
+	if (failed)
+		throw runtime_error("a worker process failed");
+
+	for (unsigned int r = 0; r < dimY; ++r) {
+		for (unsigned int c = 0; c < dimX; ++c) {
+			Cell *cell = grid.getCell(c, r);
+			cell->setW(shared.W[(size_t)r * dimX + c]);
+			cell->setDA(shared.DA[(size_t)r * dimX + c]);
+		}
+	}
+	grid.invalidateStats();
+	return shared.header->numIter;
+}
+
+#endif
+
+//-----------------------------------------------------------------
@@ -0,0 +1,55 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef DOMAIN_H
+#define DOMAIN_H
+
+#include "grid.h"
+
+/** Maximum number of worker processes of a decomposition */
+#define MAX_PROCESSES 64
+
+/** This class computes the drainage with several worker processes on the same host. The rows
+of the grid are split in horizontal bands, one per process. Each iteration, every process runs
+fastWaterTransfer over its band and then exchanges with the neighbour bands, through a POSIX
+shared memory segment, the water sent across the band edges and the W values of the edge rows.
+The total transferred water and the number of queued cells are also shared, so that all the
+processes take the same decision to stop. At the end, W and DA are gathered into the grid of
+the calling process */
+class DomainDecomposition {
+
+public:
+	/** Constructor */
+	DomainDecomposition(int numProcesses);
+
+	/** Runs the iterations of fastWaterTransfer until the water transferred in an iteration by all
+	the bands is not above minTransfer, as doFastWaterTransfer does. The W and DA values of the
+	grid must be initialized. Throws an exception if a worker process fails.
+	\return The number of iterations */
+	int run(Grid &grid, HEIGHT minTransfer, bool verbose);
+
+private:
+	/** Number of worker processes */
+	int numProcesses;
+};
+
+#endif
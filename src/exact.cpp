@@ -0,0 +1,175 @@
+#include <atomic>
+#include <memory>
+
+#include "exact.h"
+
+using namespace std;
+
+/** Directions of the cells: (dy + 1) * 3 + (dx + 1) towards the downstream cell */
+#define NO_FLOW 4
+#define UNRESOLVED 255
+
+/** Whether the path of a cell reaches an outlet */
+#define UNKNOWN_STATE 0
+#define DRAINING 1
+#define FLAT_BOUND 2
+
+/** Cells of a flat are at the same level within this tolerance (meters). The surface of the water
+left by the filling is not exactly level */
+#define FLAT_TOLERANCE 0.01f
+
+//-----------------------------------------------------------------
+
+/** Adds a value to an atomic float */
+static inline void atomicAdd(atomic<float> &target, float value)
+{
+	float current = target.load();
+	while (!target.compare_exchange_weak(current, current + value))
+		;
+}
+
+//-----------------------------------------------------------------
+
+/** Gets the cell a direction of cell i points to */
+static inline size_t getTarget(size_t i, int direction, unsigned dimX)
+{
+	return i + (ptrdiff_t)(direction / 3 - 1) * dimX + (direction % 3 - 1);
+}
+
+//-----------------------------------------------------------------
+
+void ExactAccumulation::run(Grid &grid, HEIGHT initW)
+{
+	unsigned dimX = grid.getDimX(), dimY = grid.getDimY();
+	size_t numCells = (size_t)dimX * dimY;
+	Cell *cells = grid.getCell(0, 0);
+	vector<unsigned char> directions(numCells);
+
+	// Steepest descent neighbour of each land cell, if it is strictly lower. Border and sea cells are outlets
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t r = 0; r < (ptrdiff_t)dimY; ++r) {
+		for (unsigned c = 0; c < dimX; ++c) {
+			size_t i = (size_t)r * dimX + c;
+			Cell *lowerCell = cells[i].getZ() > 0.0f ? grid.getLowerNeighbourCell(c, (unsigned)r) : 0;
+			if (!lowerCell)
+				directions[i] = NO_FLOW;
+			else if (lowerCell->getZW() < cells[i].getZW()) {
+				ptrdiff_t j = lowerCell - cells;
+				directions[i] = (unsigned char)((j / dimX - r + 1) * 3 + ((ptrdiff_t)(j % dimX) - (ptrdiff_t)c + 1));
+			}
+			else
+				directions[i] = UNRESOLVED;
+		}
+	}
+
+	// Cells that drain strictly downhill to an outlet, or into a cell still unresolved (a flat or a pit)
+	vector<unsigned char> state(numCells, UNKNOWN_STATE);
+	vector<size_t> path;
+	for (size_t i = 0; i < numCells; ++i) {
+		size_t j = i;
+		while (state[j] == UNKNOWN_STATE && directions[j] != NO_FLOW && directions[j] != UNRESOLVED) {
+			path.push_back(j);
+			j = getTarget(j, directions[j], dimX);
+		}
+		unsigned char end = state[j] != UNKNOWN_STATE ? state[j] : directions[j] == NO_FLOW ? DRAINING : FLAT_BOUND;
+		state[j] = directions[j] == UNRESOLVED ? FLAT_BOUND : end;
+		for (size_t k = 0; k < path.size(); ++k)
+			state[path[k]] = end;
+		path.clear();
+	}
+
+	// Flats: the unresolved cells drain, breadth first, to a neighbour that already drains to an outlet
+	// and is not higher. A cell flowing into a flat drains once the flat cell it flows into does, so a
+	// flat never drains into a cell upstream of it
+	vector<size_t> fifo;
+	for (size_t i = 0; i < numCells; ++i) {
+		if (state[i] != DRAINING)
+			continue;
+		unsigned x = (unsigned)(i % dimX), y = (unsigned)(i / dimX);
+		bool flatEdge = false;
+		for (unsigned ny = (y > 0 ? y - 1 : y); ny <= y + 1 && ny < dimY && !flatEdge; ++ny)
+			for (unsigned nx = (x > 0 ? x - 1 : x); nx <= x + 1 && nx < dimX; ++nx)
+				if (directions[(size_t)ny * dimX + nx] == UNRESOLVED)
+					flatEdge = true;
+		if (flatEdge)
+			fifo.push_back(i);
+	}
+	numFlatCells = 0;
+	for (size_t head = 0; head < fifo.size(); ++head) {
+		size_t i = fifo[head];
+		unsigned x = (unsigned)(i % dimX), y = (unsigned)(i / dimX);
+		for (unsigned ny = (y > 0 ? y - 1 : y); ny <= y + 1 && ny < dimY; ++ny) {
+			for (unsigned nx = (x > 0 ? x - 1 : x); nx <= x + 1 && nx < dimX; ++nx) {
+				size_t n = (size_t)ny * dimX + nx;
+				unsigned char towardsI = (unsigned char)(((int)y - (int)ny + 1) * 3 + ((int)x - (int)nx + 1));
+				if (directions[n] == UNRESOLVED && cells[i].getZW() <= cells[n].getZW() + FLAT_TOLERANCE) {
+					directions[n] = towardsI;
+					++numFlatCells;
+				}
+				else if (state[n] != FLAT_BOUND || directions[n] != towardsI)
+					continue;
+				state[n] = DRAINING;
+				fifo.push_back(n);
+			}
+		}
+	}
+	state.clear();
+
+	// Number of upstream land neighbours of each cell. The water sent to a sea cell leaves the grid
+	unique_ptr<atomic<unsigned char>[]> numUpstream(new atomic<unsigned char>[numCells]);
+	unique_ptr<atomic<float>[]> received(new atomic<float>[numCells]);
+	numSinks = 0;
+	for (size_t i = 0; i < numCells; ++i) {
+		numUpstream[i] = 0;
+		received[i] = 0.0f;
+		if (directions[i] == UNRESOLVED) {
+			directions[i] = NO_FLOW;
+			++numSinks;
+		}
+	}
+	vector<size_t> downstream(numCells);
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t i = 0; i < (ptrdiff_t)numCells; ++i) {
+		int direction = directions[i];
+		size_t j = getTarget((size_t)i, direction, dimX);
+		if (direction == NO_FLOW || cells[i].getZ() <= 0.0f || cells[j].getZ() <= 0.0f)
+			downstream[i] = (size_t)i;
+		else {
+			downstream[i] = j;
+			++numUpstream[j];
+		}
+	}
+	directions.clear();
+
+	// Kahn's algorithm: walks from the cells without upstream neighbours. The walk that adds the last
+	// upstream contribution of a cell continues into it
+	vector<size_t> sources;
+	for (size_t i = 0; i < numCells; ++i)
+		if (cells[i].getZ() > 0.0f && numUpstream[i] == 0)
+			sources.push_back(i);
+
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (ptrdiff_t s = 0; s < (ptrdiff_t)sources.size(); ++s) {
+		size_t i = sources[s];
+		for (;;) {
+			HEIGHT water = received[i];
+			cells[i].setDA(water);
+			size_t j = downstream[i];
+			if (j == i)
+				break;
+			atomicAdd(received[j], water + initW);
+			if (numUpstream[j].fetch_sub(1) != 1)
+				break;
+			i = j;
+		}
+	}
+
+	// A cell the walks never reached would be on a cycle or downstream of one, so its water is lost
+	for (size_t i = 0; i < numCells; ++i)
+		if (cells[i].getZ() > 0.0f && numUpstream[i] != 0)
+			++numSinks;
+
+	grid.invalidateStats();
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+#ifndef EXACT_H
+#define EXACT_H
+
+#include <vector>
+#include "grid.h"
+
+/** This class computes the drainage accumulation of a (filled) grid directly, without simulating
+the transfers. Each land cell drains to its steepest descent neighbour (Grid::getLowerNeighbourCell)
+if it is strictly lower. A cell without a lower neighbour on a flat drains to the neighbour that
+leads to the nearest edge of the flat, found with a breadth-first search from the cells that
+already drain to an outlet, so a flat never drains into a cell upstream of it; cells of closed
+depressions are sinks. The initial water of every cell is then
+accumulated along the drainage tree in topological order (Kahn's algorithm): the walks start at
+the cells that receive no water and continue into a cell once all its upstream neighbours have
+been added, so each cell is visited once and the walks run in parallel */
+class ExactAccumulation {
+
+public:
+	/** Sets the DA of every land cell to the water it receives when each land cell drops initW:
+	initW times the number of cells upstream of it. W is not modified */
+	void run(Grid &grid, HEIGHT initW);
+
+	/** Gets the number of cells of flats drained by the breadth-first search */
+	inline size_t getNumFlatCells() { return numFlatCells; }
+
+	/** Gets the number of land cells that do not drain (pits and closed flats), plus any cell the
+	accumulation could not reach */
+	inline size_t getNumSinks() { return numSinks; }
+
+private:
+	size_t numFlatCells, numSinks;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include <fstream>
+#include <stdexcept>
+
+#include "flowindex.h"
+
+using namespace std;
+
+/** Size of the buffer of the streams */
+#define FLOWINDEX_BUFFER_SIZE (1 << 20)
+
+//-----------------------------------------------------------------
+
+void FlowIndex::build(Grid &grid)
+{
+	dimX = grid.getDimX();
+	dimY = grid.getDimY();
+	cellDimX = grid.getCellDimX();
+	cellDimY = grid.getCellDimY();
+
+	ptrdiff_t numCells = (ptrdiff_t)dimX * dimY;
+	directions.resize(numCells);
+
+	// Water reaching the sea leaves the grid, so only land cells are followed
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t i = 0; i < numCells; ++i) {
+		Cell *downCell = grid.getDownstreamCell((unsigned)(i % dimX), (unsigned)(i / dimX));
+		if (downCell && downCell->getZ() > 0.0f) {
+			ptrdiff_t j = (ptrdiff_t)grid.getCellIndex(downCell);
+			int dx = (int)(j % dimX) - (int)(i % dimX), dy = (int)(j / dimX) - (int)(i / dimX);
+			directions[i] = (unsigned char)((dy + 1) * 3 + (dx + 1));
+		}
+		else
+			directions[i] = NO_FLOW;
+	}
+
+	buildPreorder();
+}
+
+//-----------------------------------------------------------------
+
+bool FlowIndex::buildPreorder()
+{
+	size_t numCells = (size_t)dimX * dimY;
+
+	// Upstream neighbours of each cell, grouped by cell (reusing preorder for the offsets)
+	vector<size_t> &offsets = preorder, upstream(numCells);
+	offsets.assign(numCells + 1, 0);
+	for (size_t i = 0; i < numCells; ++i)
+		if (directions[i] != NO_FLOW)
+			++offsets[getDownstream(i) + 1];
+	for (size_t i = 0; i < numCells; ++i)
+		offsets[i + 1] += offsets[i];
+	vector<size_t> position(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < numCells; ++i)
+		if (directions[i] != NO_FLOW)
+			upstream[position[getDownstream(i)]++] = i;
+	position.clear();
+
+	// Depth-first traversal from the outlets
+	preorderCells.clear();
+	preorderCells.reserve(numCells);
+	vector<size_t> stack;
+	for (size_t root = 0; root < numCells; ++root) {
+		if (directions[root] != NO_FLOW)
+			continue;
+		stack.push_back(root);
+		while (!stack.empty()) {
+			size_t i = stack.back();
+			stack.pop_back();
+			preorderCells.push_back(i);
+			for (size_t k = offsets[i]; k < offsets[i + 1]; ++k)
+				stack.push_back(upstream[k]);
+		}
+	}
+	upstream.clear();
+	upstream.shrink_to_fit();
+	if (preorderCells.size() != numCells)
+		return false;
+
+	// Subtree sizes, accumulated from the last cell of the preorder
+	preorder.assign(numCells, 0);
+	subtreeSize.assign(numCells, 1);
+	for (size_t k = numCells; k-- > 0; ) {
+		size_t i = preorderCells[k];
+		preorder[i] = k;
+		if (directions[i] != NO_FLOW)
+			subtreeSize[getDownstream(i)] += subtreeSize[i];
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------
+
+void FlowIndex::getPath(unsigned x, unsigned y, vector<size_t> &path)
+{
+	path.clear();
+	size_t i = (size_t)y * dimX + x;
+	path.push_back(i);
+	while (directions[i] != NO_FLOW) {
+		i = getDownstream(i);
+		path.push_back(i);
+	}
+}
+
+//-----------------------------------------------------------------
+
+void FlowIndex::getUpstreamCells(unsigned x, unsigned y, vector<size_t> &cells)
+{
+	size_t i = (size_t)y * dimX + x;
+	cells.assign(preorderCells.begin() + preorder[i], preorderCells.begin() + preorder[i] + subtreeSize[i]);
+}
+
+//-----------------------------------------------------------------
+
+static inline void writeUInt(ofstream &ofs, unsigned value)
+{
+	ofs.write((const char *)&value, sizeof(value));
+}
+
+static inline unsigned readUInt(ifstream &ifs)
+{
+	unsigned value;
+	ifs.read((char *)&value, sizeof(value));
+	return value;
+}
+
+void FlowIndex::save(const char *filename)
+{
+	vector<char> buffer(FLOWINDEX_BUFFER_SIZE);
+	ofstream ofs;
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	ofs.open(filename, ofstream::binary);
+
+	ofs.write("FIDX", 4);
+	writeUInt(ofs, 1);
+	writeUInt(ofs, dimX);
+	writeUInt(ofs, dimY);
+	writeUInt(ofs, cellDimX);
+	writeUInt(ofs, cellDimY);
+	ofs.write((const char *)&directions[0], directions.size());
+}
+
+//-----------------------------------------------------------------
+
+void FlowIndex::load(const char *filename)
+{
+	vector<char> buffer(FLOWINDEX_BUFFER_SIZE);
+	ifstream ifs;
+	ifs.exceptions(ifstream::failbit | ifstream::badbit);
+	ifs.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	ifs.open(filename, ifstream::binary);
+
+	char magic[4];
+	ifs.read(magic, 4);
+	if (string(magic, 4) != "FIDX" || readUInt(ifs) != 1)
+		throw runtime_error(string("not a flow index: ") + filename);
+	dimX = readUInt(ifs);
+	dimY = readUInt(ifs);
+	cellDimX = readUInt(ifs);
+	cellDimY = readUInt(ifs);
+	directions.resize((size_t)dimX * dimY);
+	ifs.read((char *)&directions[0], directions.size());
+
+	// Every direction has to stay inside the grid, and every cell has to drain to an outlet
+	for (size_t i = 0; i < directions.size(); ++i) {
+		int direction = directions[i];
+		if (direction == NO_FLOW)
+			continue;
+		unsigned x = (unsigned)(i % dimX), y = (unsigned)(i / dimX);
+		int dx = direction % 3 - 1, dy = direction / 3 - 1;
+		if (direction > 8 || (dx < 0 && x == 0) || (dx > 0 && x == dimX - 1) ||
+			(dy < 0 && y == 0) || (dy > 0 && y == dimY - 1))
+			throw runtime_error(string("not a flow index: ") + filename);
+	}
+	if (!buildPreorder())
+		throw runtime_error(string("not a flow index: ") + filename);
+}
+
+//-----------------------------------------------------------------
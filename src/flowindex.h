@@ -0,0 +1,97 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef FLOWINDEX_H
+#define FLOWINDEX_H
+
+#include <vector>
+#include "grid.h"
+
+/** This class answers flow queries on the result of a run without the grid: the downstream
+path of a cell and the cells that drain into it. It stores the flow direction of each cell
+(Grid::getDownstreamCell on the final Z + W surface, restricted to land cells as in Basins) and
+a depth-first preorder of the flow trees, where the upstream cells of a cell are the range of
+the preorder that starts at the cell */
+class FlowIndex {
+
+public:
+	/** Flow direction of the cells without a downstream land cell */
+	static const unsigned char NO_FLOW = 4;
+
+	/** Builds the index from the cells of the grid */
+	void build(Grid &grid);
+
+	/** Saves the flow directions: "FIDX", version, dimX, dimY, cellDimX, cellDimY (uint32) and
+	a direction per cell in raster order, (dy + 1) * 3 + (dx + 1) towards the downstream cell */
+	void save(const char *filename);
+
+	/** Loads a file written by save and rebuilds the preorder */
+	void load(const char *filename);
+
+	/** Gets the cells (indices in raster order) from a cell to its outlet, both included */
+	void getPath(unsigned x, unsigned y, std::vector<size_t> &path);
+
+	/** Gets the number of cells that drain into a cell, the cell included */
+	inline size_t getUpstreamCount(unsigned x, unsigned y) {
+		return subtreeSize[(size_t)y * dimX + x];
+	}
+
+	/** Gets the area (square meters) that drains into a cell */
+	inline double getUpstreamArea(unsigned x, unsigned y) {
+		return (double)getUpstreamCount(x, y) * cellDimX * cellDimY;
+	}
+
+	/** Gets the cells (indices in raster order) that drain into a cell, the cell included */
+	void getUpstreamCells(unsigned x, unsigned y, std::vector<size_t> &cells);
+
+	/** Gets X dimention of the grid */
+	inline unsigned getDimX() { return dimX; }
+
+	/** Gets Y dimention of the grid */
+	inline unsigned getDimY() { return dimY; }
+
+private:
+	/** Grid dimentions */
+	unsigned dimX, dimY;
+	/** Cell dimentions */
+	unsigned cellDimX, cellDimY;
+	/** Flow direction of each cell */
+	std::vector<unsigned char> directions;
+	/** Position of each cell in the preorder */
+	std::vector<size_t> preorder;
+	/** Number of cells of the flow tree rooted at each cell */
+	std::vector<size_t> subtreeSize;
+	/** Cell at each position of the preorder */
+	std::vector<size_t> preorderCells;
+
+	/** Gets the downstream cell of a cell, or the cell itself if it has no downstream cell */
+	inline size_t getDownstream(size_t i) {
+		int direction = directions[i];
+		return i + (ptrdiff_t)(direction / 3 - 1) * dimX + (direction % 3 - 1);
+	}
+
+	/** Computes the preorder and the subtree sizes from the flow directions. Returns false if
+	some cells are not reached from an outlet (the directions contain a cycle) */
+	bool buildPreorder();
+};
+
+#endif
@@ -4,16 +4,31 @@
 #include <cmath>
 #include <algorithm>
 #include <vector>
+#include <string>
+#include <cstdio>
+#include <stdexcept>
 #include <QtGui/QImage>
 
 
 #include "grid.h"
+#include "colortable.h"
+#include "hgtreader.h"
 
 using namespace std;
 
 #define INVSQRT2 0.70710678122310f
 #define EPSILON 0.00001f
 
+/** Cells above this altitude are voids (no data) of the DEM */
+#define VOID_MIN_HEIGHT 9000.0f
+
+/** Z values used to relabel the void cells while they are being filled */
+#define VOID_LABELLED 100000.0f
+#define VOID_QUEUED 200000.0f
+
+/** Number of rows formatted in parallel before being written to a PLY file */
+#define PLY_BLOCK_ROWS 256u
+
 #ifndef INFINITY
 	#include <limits>
 	#define INFINITY std::numeric_limits<float>::infinity();
@@ -27,69 +42,235 @@ Grid::Grid(unsigned dimX, unsigned dimY, unsigned cellDimX, unsigned cellDimY)
     this->dimY = dimY;
     this->cellDimX = cellDimX;
     this->cellDimY = cellDimY;
-    cells = new Cell[dimX * dimY];
+    originX = originY = 0;
+    allocateCells();
+    statsValid = false;
+    buildLandIndex();
+    setBand(0, dimY);
 }
 
 //-----------------------------------------------------------------
 
 void Grid::loadHGT(const char *filename, unsigned dimX, unsigned dimY, unsigned cellDimX, unsigned cellDimY)
 {
-    ifstream ifs;
-    ifs.exceptions(ifstream::failbit | ifstream::badbit);    
-    ifs.open(filename, ifstream::binary);
+    HGTReader reader(filename);
 
+    // Cells buffer is reused if the size does not change
+    bool resize = (size_t)dimX * dimY != (size_t)this->dimX * this->dimY;
+    if (resize)
+        freeLarge(cells, (size_t)this->dimX * this->dimY * sizeof(Cell));
     this->dimX = dimX;
     this->dimY = dimY;
+    if (resize)
+        allocateCells();
     this->cellDimX = cellDimX;
     this->cellDimY = cellDimY;
-    delete[] cells;
-    cells = new Cell[dimX * dimY];
-
-    // Load data
-    for (unsigned int r = 0; r < dimY; ++r) {
-        for (unsigned int c = 0; c < dimX; ++c) {
-            getCell(c, r)->setZ((ifs.get() << 8) | ifs.get());
-            getCell(c, r)->setDA(0.0f);
+    originX = originY = 0;
+    statsValid = false;
+
+    // Load data: big-endian samples, converted while the reader inflates the next chunk
+    size_t numCells = (size_t)dimX * dimY, i = 0, bytes;
+    const unsigned char *chunk;
+    bool voids = false;
+    while (i < numCells && (chunk = reader.next(bytes)) != 0) {
+        size_t n = min(bytes / 2, numCells - i);
+        for (size_t k = 0; k < n; ++k) {
+            HEIGHT z = (HEIGHT)((chunk[2 * k] << 8) | chunk[2 * k + 1]);
+            cells[i + k] = Cell();
+            cells[i + k].setZ(z);
+            voids |= z > VOID_MIN_HEIGHT;
         }
+        i += n;
     }
+    if (i < numCells)
+        throw runtime_error(string("truncated HGT file: ") + filename);
 
     // Fill holes
-    Cell *cell;
-    for (unsigned int r = 0; r < dimY; ++r) {
-        for (unsigned int c = 0; c < dimX; ++c) {
-            cell = getCell(c, r);
-            if (cell->getZW() > 9000) {
-                cell->setZ(getNeighbourMeanZ(c, r));
-            }
-        }
-    }
+    if (voids)
+        fillVoids();
+
+    buildLandIndex();
+    setBand(0, dimY);
 }
 
 //-----------------------------------------------------------------
 
-double log10Value( double value, double maxValue )
+void Grid::crop(unsigned firstX, unsigned firstY, unsigned dimX, unsigned dimY, const unsigned char *keep)
 {
-	// Input will be between minValue and maxValue
-	double minValue = 0;
+	Cell *oldCells = cells;
+	unsigned oldDimX = this->dimX, oldDimY = this->dimY;
+
+	this->dimX = dimX;
+	this->dimY = dimY;
+	originX += firstX;
+	originY += firstY;
+	allocateCells();
+	statsValid = false;
+
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t r = 0; r < (ptrdiff_t)dimY; ++r) {
+		const Cell *source = oldCells + (size_t)(firstY + r) * oldDimX + firstX;
+		Cell *cell = getCell(0, (unsigned)r);
+		for (unsigned int c = 0; c < dimX; ++c)
+			if (!keep || keep[(size_t)r * dimX + c])
+				cell[c] = source[c];
+	}
+	freeLarge(oldCells, (size_t)oldDimX * oldDimY * sizeof(Cell));
+
+	buildLandIndex();
+	setBand(0, dimY);
+}
+
+//-----------------------------------------------------------------
+
+void Grid::allocateCells()
+{
+	cells = (Cell *)allocLarge((size_t)dimX * dimY * sizeof(Cell));
+
+	double start = getSeconds();
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t r = 0; r < (ptrdiff_t)dimY; ++r) {
+		Cell *cell = getCell(0, (unsigned)r);
+		for (unsigned int c = 0; c < dimX; ++c)
+			new (cell + c) Cell();
+	}
+	addLargeInitTime(getSeconds() - start);
+}
+
+//-----------------------------------------------------------------
+
+void Grid::buildLandIndex()
+{
+	landRuns.clear();
+	numLandCells = 0;
+	for (unsigned int r = 0; r < dimY; ++r) {
+		for (unsigned int c = 0; c < dimX; ++c) {
+			if (getCell(c, r)->getZ() > 0.0f) {
+				LandRun run;
+				run.row = r;
+				run.begin = c;
+				while (c < dimX && getCell(c, r)->getZ() > 0.0f)
+					++c;
+				run.end = c;
+				landRuns.push_back(run);
+				numLandCells += run.end - run.begin;
+			}
+		}
+	}
 
-	//output will be between minv and maxv
-	double minv = log10(1.0);
-	double maxv = log10(maxValue);
+	// Neighbours in the order rows from y - 1 to y + 1, columns from x - 1 to x + 1
+	int n = 0;
+	for (int r = -1; r <= 1; ++r) {
+		for (int c = -1; c <= 1; ++c) {
+			if (c != 0 || r != 0) {
+				neighbourOffsets[n] = r * (int)dimX + c;
+				neighbourWeights[n] = (c != 0 && r != 0) ? INVSQRT2 : 1.0f;
+				++n;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------
 
-	// Adjustment factor
-	double scale = (maxv - minv) / (maxValue - minValue);
-	return pow(10.0, minv + (scale * (value - minValue)));
+void Grid::fillVoids()
+{
+	// Collect the 8-connected void regions. Cells of region i are
+	// voidCells[regionStart[i]] ... voidCells[regionStart[i + 1] - 1]
+	vector<size_t> voidCells;
+	vector<size_t> regionStart;
+	size_t numCells = (size_t)dimX * dimY;
+
+	for (size_t i = 0; i < numCells; ++i) {
+		if (cells[i].getZ() <= VOID_MIN_HEIGHT || cells[i].getZ() == VOID_LABELLED)
+			continue;
+
+		regionStart.push_back(voidCells.size());
+		voidCells.push_back(i);
+		cells[i].setZ(VOID_LABELLED);
+		for (size_t head = regionStart.back(); head < voidCells.size(); ++head) {
+			unsigned x = voidCells[head] % dimX, y = voidCells[head] / dimX;
+			for (unsigned r = max(y, 1u) - 1; r <= min(y + 1, dimY - 1); ++r) {
+				for (unsigned c = max(x, 1u) - 1; c <= min(x + 1, dimX - 1); ++c) {
+					Cell *cell = getCell(c, r);
+					if (cell->getZ() > VOID_MIN_HEIGHT && cell->getZ() != VOID_LABELLED) {
+						cell->setZ(VOID_LABELLED);
+						voidCells.push_back((size_t)r * dimX + c);
+					}
+				}
+			}
+		}
+	}
+	regionStart.push_back(voidCells.size());
+
+	// Regions are independent: each one only reads its boundary and writes its own cells
+	#pragma omp parallel for schedule(dynamic)
+	for (ptrdiff_t i = 0; i < (ptrdiff_t)regionStart.size() - 1; ++i)
+		fillVoidRegion(&voidCells[regionStart[i]], regionStart[i + 1] - regionStart[i]);
 }
 
-void computeColor(int &r, int &g, int &b, double value, double maxValue)
+//-----------------------------------------------------------------
+
+void Grid::fillVoidRegion(const size_t *regionCells, size_t numRegionCells)
 {
-	value = maxValue - value/* - 1.0*/;
-	double valueLog = log10Value( value, maxValue );
-	r = 0;
-	//from 255 (min) to 0 (max)
-	g = 255 * valueLog / maxValue;
-	b = 255;
-	return;
+	// FIFO of cells ordered by their distance to the boundary of the void
+	vector<size_t> fifo;
+	vector<HEIGHT> values;
+	fifo.reserve(numRegionCells);
+
+	// First layer: cells with a valid neighbour
+	for (size_t i = 0; i < numRegionCells; ++i) {
+		unsigned x = regionCells[i] % dimX, y = regionCells[i] / dimX;
+		bool boundary = false;
+		for (unsigned r = max(y, 1u) - 1; r <= min(y + 1, dimY - 1) && !boundary; ++r)
+			for (unsigned c = max(x, 1u) - 1; c <= min(x + 1, dimX - 1); ++c)
+				if (getCell(c, r)->getZ() <= VOID_MIN_HEIGHT)
+					boundary = true;
+		if (boundary) {
+			cells[regionCells[i]].setZ(VOID_QUEUED);
+			fifo.push_back(regionCells[i]);
+		}
+	}
+
+	// A void covering the whole grid has no boundary to interpolate from
+	if (fifo.empty()) {
+		for (size_t i = 0; i < numRegionCells; ++i)
+			cells[regionCells[i]].setZ(0.0f);
+		return;
+	}
+
+	// Propagate inwards layer by layer. Each cell gets the inverse distance weighted
+	// mean of its neighbours filled in previous layers
+	size_t layerBegin = 0;
+	while (layerBegin < fifo.size()) {
+		size_t layerEnd = fifo.size();
+		values.resize(layerEnd - layerBegin);
+
+		for (size_t i = layerBegin; i < layerEnd; ++i) {
+			unsigned x = fifo[i] % dimX, y = fifo[i] / dimX;
+			HEIGHT sumZ = 0.0f, sumWeights = 0.0f;
+
+			for (unsigned r = max(y, 1u) - 1; r <= min(y + 1, dimY - 1); ++r) {
+				for (unsigned c = max(x, 1u) - 1; c <= min(x + 1, dimX - 1); ++c) {
+					Cell *cell = getCell(c, r);
+					if (cell->getZ() <= VOID_MIN_HEIGHT) {
+						HEIGHT weight = (c != x && r != y) ? INVSQRT2 : 1.0f;
+						sumZ += weight * cell->getZ();
+						sumWeights += weight;
+					}
+					else if (cell->getZ() == VOID_LABELLED) {
+						cell->setZ(VOID_QUEUED);
+						fifo.push_back((size_t)r * dimX + c);
+					}
+				}
+			}
+			values[i - layerBegin] = sumZ / sumWeights;
+		}
+
+		for (size_t i = layerBegin; i < layerEnd; ++i)
+			cells[fifo[i]].setZ(values[i - layerBegin]);
+		layerBegin = layerEnd;
+	}
 }
 
 //-----------------------------------------------------------------
@@ -102,7 +283,7 @@ void Grid::savePLY(const char *filename)
 
 	ofs << "ply" << endl;
 	ofs << "format ascii 1.0" << endl;
-	ofs << "element vertex " << dimX * dimY << endl;
+	ofs << "element vertex " << (size_t)dimX * dimY << endl;
 	ofs << "property float x" << endl;
 	ofs << "property float y" << endl;
 	ofs << "property float z"  << endl;
@@ -111,36 +292,46 @@ void Grid::savePLY(const char *filename)
 	ofs << "property uchar blue"  << endl;
 	ofs << "end_header" << endl;
 
-	int colorR, colorG, colorB;
-	Cell *cell;
-	HEIGHT height;
-
-	HEIGHT maxAccumW = getMaxDA();
-
-    for (unsigned int r = 0; r < dimY; ++r) {
-        for (unsigned int c = 0; c < dimX; ++c) {
-            cell = getCell(c, r);
-            height = cell->getZ();
-            
-			//assign a color according to the height
-			cell->getHeightColor(colorR, colorG, colorB);
-
-			if( height == 0.0f ){
-				colorB = 255;
-				colorG = 0;
-				colorR = 0;
-
-			}else 
-				if( cell->isInResult() ){	
-					computeColor(colorR, colorG, colorB, cell->getDA(), maxAccumW);
-				} 
-
-            ofs << 0.1f * r << " ";
-            ofs << 0.1f * c << " ";
-            ofs << 0.3f * height / cellDimX << " ";
-            ofs << colorR << " " << colorG << " " << colorB << endl;
-        }
-    }
+	ColorTable colors;
+	colors.setupRamp(getMaxDA());
+
+	// Rows are formatted in parallel by blocks and written in order
+	vector<string> lines(PLY_BLOCK_ROWS);
+
+	for (unsigned int r0 = 0; r0 < dimY; r0 += PLY_BLOCK_ROWS) {
+		int r1 = (int)min(r0 + PLY_BLOCK_ROWS, dimY);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int r = r0; r < r1; ++r) {
+			string &line = lines[r - r0];
+			char buffer[128];
+			int colorR, colorG, colorB;
+			unsigned color;
+			HEIGHT height;
+			Cell *cell = getCell(0, r);
+
+			line.clear();
+			for (unsigned int c = 0; c < dimX; ++c, ++cell) {
+				height = cell->getZ();
+
+				//assign a color according to the height
+				if( height == 0.0f )
+					color = ColorTable::pack(0, 0, 255);
+				else if( cell->isInResult() )
+					color = colors.getRampColor(cell->getDA());
+				else
+					color = colors.getHeightColor(height);
+				ColorTable::unpack(color, colorR, colorG, colorB);
+
+				sprintf(buffer, "%g %g %g %d %d %d\n", 0.1f * r, 0.1f * c, 0.3f * height / cellDimX,
+					colorR, colorG, colorB);
+				line += buffer;
+			}
+		}
+
+		for (int r = r0; r < r1; ++r)
+			ofs << lines[r - r0];
+	}
 }
 
 
@@ -149,49 +340,34 @@ void Grid::savePLY(const char *filename)
 bool Grid::saveImageDA(const char *filename)
 {
 	#ifdef QT_CORE_LIB 
-		int colorR, colorG, colorB;
-		Cell *cell;
-		HEIGHT height, accumWH;
-		HEIGHT maxAccumW = getMaxDA();
+		ColorTable colors;
+		colors.setupRamp(getMaxDA());
+
+		const unsigned water = ColorTable::pack(0, 0, 255);
+		const unsigned black = ColorTable::pack(0, 0, 0);
 
 		//data must be 32 bit aligned for QImage
-		unsigned char *iDataColor = new unsigned char[4* dimX * dimY];
+		unsigned *iDataColor = new unsigned[(size_t)dimX * dimY];
 		if( !iDataColor )
 			return false;
 
-		unsigned int posData = 0;
-
-		for (unsigned int r = 0; r < dimY; ++r) {
-			for (unsigned int c = 0; c < dimX; ++c) {
-				cell = getCell(c, r);
-
-				accumWH = cell->getDA();
-				height = cell->getZ();
-
-				if( cell->getZW() == 0.0f ){
-					colorB = 255;
-					colorG = 0;
-					colorR = 0;
-				}else if( cell->isInResult() ){	
-					computeColor(colorR, colorG, colorB, accumWH, maxAccumW);
-				} 
-				else{
-					colorB = 0;
-					colorG = 0;
-					colorR = 0;
-				}
-
-				iDataColor[posData]   = colorB; //blue
-				iDataColor[posData+1] = colorG; //green
-				iDataColor[posData+2] = colorR; //red
-				iDataColor[posData+3] = 255; //alpha
-
-				posData += 4;
+		#pragma omp parallel for schedule(static)
+		for (int r = 0; r < (int)dimY; ++r) {
+			Cell *cell = getCell(0, r);
+			unsigned *line = iDataColor + (size_t)r * dimX;
+
+			for (unsigned int c = 0; c < dimX; ++c, ++cell) {
+				if( cell->getZW() == 0.0f )
+					line[c] = water;
+				else if( cell->isInResult() )
+					line[c] = colors.getRampColor(cell->getDA());
+				else
+					line[c] = black;
 			}
 		}
 
 		//create a qimage in memory with the image
-		QImage iImageColor = QImage( iDataColor, dimX, dimY, QImage::Format_RGB32 );
+		QImage iImageColor = QImage( (uchar *)iDataColor, dimX, dimY, QImage::Format_RGB32 );
 
 		//vertical flip of the image
 		//iImageColor = iImageColor.mirrored( false, true );
@@ -208,57 +384,32 @@ bool Grid::saveImageDA(const char *filename)
 
 //-----------------------------------------------------------------
 
-void computeColorWater(int &r, int &g, int &b, double value, double maxValue)
-{
-	if( value == 0.0 ){
-		r = 0;
-		g = 0;
-		b = 0;
-	}
-	else{
-		value = maxValue - value/* - 1.0*/;
-		double valueLog = log10Value( value, maxValue );
-		r = 0;
-		//from 255 (min) to 0 (max)
-		g = 255 * valueLog / maxValue;
-		b = 255;
-	}
-}
-
-//-----------------------------------------------------------------
-
 bool Grid::saveImageW(const char *filename)
 {
 	#ifdef QT_CORE_LIB 
 
-		int colorR, colorG, colorB;
-		Cell *cell;
-		HEIGHT WH;
-		HEIGHT max = getMaxW();
-		
-		unsigned char *iDataColor = new unsigned char[4* dimX * dimY];
+		ColorTable colors;
+		colors.setupRamp(getMaxW());
+
+		const unsigned dry = ColorTable::pack(0, 0, 0);
+
+		unsigned *iDataColor = new unsigned[(size_t)dimX * dimY];
 		if( !iDataColor )
 			return false;
 
-		unsigned int posData = 0;
-
-		for (unsigned int r = 0; r < dimY; ++r) {
-			for (unsigned int c = 0; c < dimX; ++c) {
-			
-				cell = getCell(c, r);
-				WH = cell->getW();
-				computeColorWater(colorR, colorG, colorB, WH, max);
-				iDataColor[posData]   = colorB; //blue
-				iDataColor[posData+1] = colorG; //green
-				iDataColor[posData+2] = colorR; //red
-				iDataColor[posData+3] = 255; //alpha
+		#pragma omp parallel for schedule(static)
+		for (int r = 0; r < (int)dimY; ++r) {
+			Cell *cell = getCell(0, r);
+			unsigned *line = iDataColor + (size_t)r * dimX;
 
-				posData += 4;
+			for (unsigned int c = 0; c < dimX; ++c, ++cell) {
+				HEIGHT WH = cell->getW();
+				line[c] = WH == 0.0f ? dry : colors.getRampColor(WH);
 			}
 		}
 
 		//create a qimage in memory with the image
-		QImage iImageColor = QImage( iDataColor, dimX, dimY, QImage::Format_RGB32 );
+		QImage iImageColor = QImage( (uchar *)iDataColor, dimX, dimY, QImage::Format_RGB32 );
 
 		//vertical flip of the image
 		//iImageColor = iImageColor.mirrored( false, true );
@@ -277,56 +428,101 @@ bool Grid::saveImageW(const char *filename)
 
 Grid::~Grid()
 {
-	delete[] cells;
+	freeLarge(cells, (size_t)dimX * dimY * sizeof(Cell));
 }
 
 //-----------------------------------------------------------------
 
 void Grid::addW(HEIGHT wh)
 {
-	for (unsigned int r = 0; r < dimY; ++r) {
-		for (unsigned int c = 0; c < dimX; ++c) {
-			Cell *cell = getCell(c, r);
-			cell->setW(wh + cell->getW());
-		}
-	}
+	SweepOps ops;
+	ops.addW = true;
+	ops.dw = wh;
+	sweep(ops);
 }
 
 //-----------------------------------------------------------------
 
 void Grid::setW(HEIGHT wh)
 {
-    for (unsigned int r = 0; r < dimY; ++r) {
-        for (unsigned int c = 0; c < dimX; ++c) {
-          getCell(c, r)->setW(wh);
-        }
-    }
+	SweepOps ops;
+	ops.setW = true;
+	ops.w = wh;
+	sweep(ops);
 }
 
 //-----------------------------------------------------------------
 
 void Grid::setDA(HEIGHT wh)
 {
-    for (unsigned int r = 0; r < dimY; ++r) {
-        for (unsigned int c = 0; c < dimX; ++c) {
-          getCell(c, r)->setDA(wh);
-        }
-    }
+	SweepOps ops;
+	ops.setDA = true;
+	ops.da = wh;
+	sweep(ops);
 }
 
 //-----------------------------------------------------------------
 
 void Grid::markAsResultDAOver(HEIGHT wh)
 {
-    Cell *cell;
+	SweepOps ops;
+	ops.markResult = true;
+	ops.daThreshold = wh;
+	sweep(ops);
+}
 
-    for (unsigned int r = 0; r < dimY; ++r) {
-        for (unsigned int c = 0; c < dimX; ++c) {
-            cell = getCell(c, r);
-            if (cell->getDA() >= wh)
-                cell->markAsResult();
-        }
-    }
+//-----------------------------------------------------------------
+
+SweepStats Grid::sweep(const SweepOps &ops)
+{
+	// Sea cells never hold water nor DA, so they can be skipped unless they are given a
+	// DA value or could be marked as result
+	bool landOnly = (!ops.setDA || ops.da == 0.0f) && (!ops.markResult || ops.daThreshold > 0.0f);
+	ptrdiff_t numRows = dimY, numRuns = landRuns.size();
+
+	stats.maxDA = 0.0f;
+	stats.maxW = 0.0f;
+	stats.numResult = 0;
+
+	#pragma omp parallel
+	{
+		HEIGHT maxDA = 0.0f, maxW = 0.0f;
+		size_t numResult = 0;
+
+		#pragma omp for schedule(static)
+		for (ptrdiff_t i = 0; i < (landOnly ? numRuns : numRows); ++i) {
+			Cell *cell = landOnly ? getCell(landRuns[i].begin, landRuns[i].row) : getCell(0, (unsigned)i);
+			Cell *end = landOnly ? getCell(landRuns[i].end, landRuns[i].row) : getCell(0, (unsigned)i + 1);
+
+			for (; cell < end; ++cell) {
+				if (ops.setW)
+					cell->setW(ops.w);
+				if (ops.addW)
+					cell->setW(ops.dw + cell->getW());
+				if (ops.setDA)
+					cell->setDA(ops.da);
+				if (ops.markResult && cell->getDA() >= ops.daThreshold)
+					cell->markAsResult();
+
+				if (cell->getDA() > maxDA)
+					maxDA = cell->getDA();
+				if (cell->getW() > maxW)
+					maxW = cell->getW();
+				if (cell->isInResult())
+					++numResult;
+			}
+		}
+
+		#pragma omp critical
+		{
+			stats.maxDA = max(stats.maxDA, maxDA);
+			stats.maxW = max(stats.maxW, maxW);
+			stats.numResult += numResult;
+		}
+	}
+
+	statsValid = true;
+	return stats;
 }
 
 //-----------------------------------------------------------------
@@ -336,9 +532,11 @@ HEIGHT Grid::dry()
 	Cell *cell, *lowerCell;
 	HEIGHT accumMovingWater = 0.0f;
 
-    for (unsigned int r = 0; r < dimY; ++r) {
-        for (unsigned int c = 0; c < dimX; ++c) {
-            cell = getCell(c, r);
+	statsValid = false;
+	for (size_t i = 0; i < landRuns.size(); ++i) {
+		unsigned r = landRuns[i].row;
+		for (unsigned c = landRuns[i].begin; c < landRuns[i].end; ++c) {
+			cell = getCell(c, r);
 			HEIGHT currentCellW = cell->getW();
 
 			if (currentCellW > 0.0f) {
@@ -363,19 +561,73 @@ HEIGHT Grid::dry()
 //-----------------------------------------------------------------
 
 
-void Grid::setupFastWaterTransfer()
+void Grid::setupFastWaterTransfer(HEIGHT freezeTransfer)
 {
-	unsigned numCells = dimX * dimY;
 	processingCells.clear();
-	processingCells.resize(numCells + 1);
-
-	Cell *cell = cells;
-	for (unsigned int c = 0; c < numCells; ++c) {
-		processingCells.push(cell++);
+	processingCells.resize(numLandCells + 1);
+	numQueuedCells = 0;
+
+	// Sea cells never hold water
+	for (size_t i = 0; i < landRuns.size(); ++i) {
+		if (landRuns[i].row < bandFirstRow || landRuns[i].row >= bandEndRow)
+			continue;
+		for (unsigned c = landRuns[i].begin; c < landRuns[i].end; ++c)
+			queueCell(getCell(c, landRuns[i].row));
 	}
 
 	// Push ending token
 	processingCells.push(0);
+
+	// Active tiles
+	numTilesX = (dimX + TILE_SIZE - 1) / TILE_SIZE;
+	numTilesY = (dimY + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned numTiles = freezeTransfer > 0.0f ? numTilesX * numTilesY : 0;
+	tileFreezeTransfer = freezeTransfer / numTilesX / numTilesY;
+	frozenTiles.assign(numTiles, false);
+	tileTransfer.assign(numTiles, 0.0f);
+	parkedCells.clear();
+	parkedCells.resize(numTiles);
+}
+
+//-----------------------------------------------------------------
+
+void Grid::setBand(unsigned firstRow, unsigned endRow)
+{
+	bandFirstRow = firstRow;
+	bandEndRow = endRow;
+	bandOutflow.assign(2 * (size_t)dimX, 0.0f);
+}
+
+//-----------------------------------------------------------------
+
+void Grid::clearBandOutflow()
+{
+	fill(bandOutflow.begin(), bandOutflow.end(), 0.0f);
+}
+
+//-----------------------------------------------------------------
+
+void Grid::receiveBandInflow(unsigned row, const HEIGHT *water)
+{
+	statsValid = false;
+	for (unsigned int c = 0; c < dimX; ++c) {
+		Cell *cell = getCell(c, row);
+		if (water[c] > 0.0f && cell->getZ() > 0.0f) {
+			if (cell->getW() < EPSILON)
+				queueCell(cell);
+			cell->addW(+water[c]);
+		}
+	}
+}
+
+//-----------------------------------------------------------------
+
+void Grid::wakeTile(unsigned tile)
+{
+	frozenTiles[tile] = false;
+	for (size_t i = 0; i < parkedCells[tile].size(); ++i)
+		queueCell(parkedCells[tile][i]);
+	parkedCells[tile].clear();
 }
 
 //-----------------------------------------------------------------
@@ -384,10 +636,25 @@ HEIGHT Grid::fastWaterTransfer()
 {
 	HEIGHT movingWater, accumMovingWater = 0.0f;
 	Cell *cell, *lowerCell;
+	bool activeTiles = !frozenTiles.empty();
+	unsigned tile = 0, lowerTile;
+	Cell *bandBegin = cells + (size_t)bandFirstRow * dimX, *bandEnd = cells + (size_t)bandEndRow * dimX;
 
+	statsValid = false;
 	// Iterate until we find the ending token
 	while ((cell = processingCells.top()) != 0) {
 		processingCells.pop();
+		--numQueuedCells;
+
+		// Cells of frozen tiles wait until a neighbour sends water to the tile
+		if (activeTiles) {
+			tile = getTile(cell);
+			if (frozenTiles[tile]) {
+				parkedCells[tile].push_back(cell);
+				continue;
+			}
+		}
+
 		lowerCell = getLowerNeighbourCell(cell);
 		movingWater = lowerCell ? min(cell->getW(), 0.5f * (cell->getZW() - lowerCell->getZW())) : cell->getW();
 
@@ -396,23 +663,44 @@ HEIGHT Grid::fastWaterTransfer()
 			//remove water from current cell
 			cell->addW(-movingWater);
 
-			if (lowerCell && lowerCell->getZ() > 0.0f) {
+			if (lowerCell && lowerCell->getZ() > 0.0f && (lowerCell < bandBegin || lowerCell >= bandEnd)) {
+				// Halo cell of a neighbour band: it receives the water at the next exchange
+				size_t column = (size_t)(lowerCell - cells) % dimX;
+				bandOutflow[lowerCell < bandBegin ? column : dimX + column] += movingWater;
+				lowerCell->addW(+movingWater);
+			}
+			else if (lowerCell && lowerCell->getZ() > 0.0f) {
+				if (activeTiles) {
+					lowerTile = getTile(lowerCell);
+					if (frozenTiles[lowerTile])
+						wakeTile(lowerTile);
+					tileTransfer[lowerTile] += movingWater;
+				}
 				//if the neighbour cell did not have water, we pushed it into the FIFO because it is going to recieve water
 				if (lowerCell->getW() < EPSILON)
-					processingCells.push(lowerCell);
+					queueCell(lowerCell);
 				lowerCell->addW(+movingWater);
 			}
 			accumMovingWater += movingWater;
+			if (activeTiles)
+				tileTransfer[tile] += movingWater;
 		}
 		//if the current cell still has water, we pushed it into the FIFO
 		if (cell->getW() > EPSILON)
-		processingCells.push(cell);
+		queueCell(cell);
 	}
 
 	//remove ending token and add it again after the new list of cells to process
 	processingCells.pop();
 	processingCells.push(0);
 
+	// Freeze the tiles that sent or received little water during this iteration
+	for (size_t t = 0; t < tileTransfer.size(); ++t) {
+		if (tileTransfer[t] < tileFreezeTransfer)
+			frozenTiles[t] = true;
+		tileTransfer[t] = 0.0f;
+	}
+
 	return accumMovingWater;
 }
 
@@ -429,25 +717,14 @@ Cell *Grid::getLowerNeighbourCell(unsigned x, unsigned y)
 		return NULL;
 	}
 
-	Cell *lowerCell = 0;
-
-	int rMin = max(0, (int)y - 1);
-	int rMax = min(y + 2, dimY);
-	int cMin = max(0, (int)x - 1);
-	int cMax = min(x + 2, dimX);
-
-	for (int r = rMin; r < rMax; ++r) {
-		for (int c = cMin; c < cMax; ++c) {
-			if (c != x || r != y) {
-				slope = cellHeight - getCell(c, r)->getZW();
-				if (c != x && r != y)
-					slope *= INVSQRT2;
+	Cell *cell = getCell(x, y), *lowerCell = 0;
 
-				if (slope > higherSlope) {
-					higherSlope = slope;
-					lowerCell = getCell(c, r);
-				}
-			}
+	// Interior cells have the 8 neighbours of the table
+	for (int n = 0; n < 8; ++n) {
+		slope = (cellHeight - cell[neighbourOffsets[n]].getZW()) * neighbourWeights[n];
+		if (slope > higherSlope) {
+			higherSlope = slope;
+			lowerCell = cell + neighbourOffsets[n];
 		}
 	}
 	return lowerCell;
@@ -455,60 +732,3 @@ Cell *Grid::getLowerNeighbourCell(unsigned x, unsigned y)
 
 //-----------------------------------------------------------------
 
-HEIGHT Grid::getNeighbourMeanZ(unsigned x, unsigned y)
-{ 
-	HEIGHT ch, h, mh = 0;
-	unsigned nn = 0;
-
-	ch = getCell(x, y)->getZ();
-
-	for (unsigned int r = y - 1; r <= y + 1; ++r) {
-		for (unsigned int c = x - 1; c <= x + 1; ++c) {
-			if (c >= 0 && r >= 0 && c < dimX && r < dimY && c != x && r != y) {
-				if ((h = getCell(c, r)->getZ()) < 9000) {
-					mh += h;
-					++nn;
-				}
-			}
-		}
-	}
-	if( nn > 0 )
-		return mh / nn;
-	return 0;
-}
-
-//-----------------------------------------------------------------
-
-HEIGHT Grid::getMaxDA()
-{
-	Cell *cell;
-	HEIGHT max = 0.0;
-	for (unsigned int r = 0; r < dimY; ++r) {
-		for (unsigned int c = 0; c < dimX; ++c) {
-			cell = getCell(c, r);
-			HEIGHT a = cell->getDA();
-			if( a > max )
-				max = a;
-		}
-	}
-	return max;
-}
-
-//-----------------------------------------------------------------
-
-HEIGHT Grid::getMaxW()
-{
-	Cell *cell;
-	HEIGHT max = 0.0;
-	for (unsigned int r = 0; r < dimY; ++r) {
-		for (unsigned int c = 0; c < dimX; ++c) {
-			cell = getCell(c, r);
-			HEIGHT a = cell->getW();
-			if( a > max )
-				max = a;
-		}
-	}
-	return max;
-}
-
-//-----------------------------------------------------------------
@@ -22,8 +22,46 @@
 #ifndef GRID_H
 #define GRID_H
 
+#include <vector>
 #include "cell.h"
 #include "circqueue.h"
+#include "memory.h"
+
+/** Size (in cells) of the square tiles used to freeze converged regions in fastWaterTransfer */
+#define TILE_SIZE 64
+
+/** Per-cell operations applied by Grid::sweep, in the order they are declared */
+struct SweepOps {
+	/** Constructor. No operation is enabled */
+	SweepOps() : setW(false), addW(false), setDA(false), markResult(false),
+		w(0.0f), dw(0.0f), da(0.0f), daThreshold(0.0f) {}
+
+	/** Sets W to the value w */
+	bool setW;
+	/** Adds the value dw to W */
+	bool addW;
+	/** Sets DA to the value da */
+	bool setDA;
+	/** Marks as result each cell with a DA value above daThreshold */
+	bool markResult;
+
+	HEIGHT w, dw, da, daThreshold;
+};
+
+/** Reductions computed by Grid::sweep after applying the operations */
+struct SweepStats {
+	/** Maximum DA value of the DEM cells */
+	HEIGHT maxDA;
+	/** Maximum W value of the DEM cells */
+	HEIGHT maxW;
+	/** Number of cells marked as result */
+	size_t numResult;
+};
+
+/** Horizontal run of land cells of a grid row: columns begin to end - 1 */
+struct LandRun {
+	unsigned row, begin, end;
+};
 
 /** This class defines the grid that contains the DEM cells */	
 class Grid {
@@ -35,6 +73,11 @@ public:
 	/** Initializes a grid from a HGT file */
 	void loadHGT(const char *filename, unsigned dimX = 1201, unsigned dimY = 1201, unsigned cellDimX = 90, unsigned cellDimY = 90);
 
+	/** Reduces the grid to the dimX x dimY cells whose first cell is firstX, firstY. If keep is given
+	(a value per cell of the new grid), the cells with a zero value become sea, so that the water
+	reaching them leaves the grid and the simulation passes skip them */
+	void crop(unsigned firstX, unsigned firstY, unsigned dimX, unsigned dimY, const unsigned char *keep = 0);
+
 	/** Destrois the grid and clean up memory*/
 	~Grid();
 
@@ -61,6 +104,13 @@ public:
 	/** Mark as result cell each cell with a DA value above the provided value*/
 	void markAsResultDAOver(HEIGHT wh);
 
+	/** Applies several per-cell operations in one parallel pass over the cells buffer.
+	\return The reductions computed over the updated cells */
+	SweepStats sweep(const SweepOps &ops);
+
+	/** Discards the cached reductions after the cells have been modified directly */
+	inline void invalidateStats() { statsValid = false; }
+
 	/**Computes an interation of the algortihm used to fill the pits of the dem
 	\return The total water eliminated during this iteration*/
 	HEIGHT dry();
@@ -70,9 +120,41 @@ public:
 	\return The total water transferred during this iteration*/
 	HEIGHT fastWaterTransfer();
 
-	/** Initializes the algorithm to use the fast version with the FIFO. This method should be
-	called before any call to fastWaterTransfer*/
-	void setupFastWaterTransfer();
+	/** Initializes the algorithm to use the fast version with the FIFO, filled with the land cells.
+	This method should be called before any call to fastWaterTransfer.
+	If freezeTransfer is positive, the grid is divided in tiles of TILE_SIZE x TILE_SIZE cells. A tile
+	that sends or receives less than freezeTransfer / (number of tiles) water in an iteration is frozen:
+	its cells are not processed until a neighbour cell sends water into the tile*/
+	void setupFastWaterTransfer(HEIGHT freezeTransfer = 0.0f);
+
+	/** Gets the number of cells waiting in the FIFO of fastWaterTransfer */
+	inline size_t getNumQueuedCells() { return numQueuedCells; }
+
+	/** Restricts fastWaterTransfer to the rows firstRow to endRow - 1 (the band). Must be called
+	before setupFastWaterTransfer. The rows just above and below the band are a copy (halo) of the
+	neighbour bands: the water sent to them is added to the halo and accumulated in the band outflow,
+	and their cells are never processed. Loading a grid resets the band to all the rows */
+	void setBand(unsigned firstRow, unsigned endRow);
+
+	/** Gets the water sent to the halo rows since the last call to clearBandOutflow: dimX values
+	for the row above the band followed by dimX values for the row below */
+	inline const HEIGHT *getBandOutflow() { return &bandOutflow[0]; }
+
+	/** Resets the band outflow */
+	void clearBandOutflow();
+
+	/** Adds the water sent by a neighbour band to a row of the band (dimX values), queueing the cells
+	that receive water */
+	void receiveBandInflow(unsigned row, const HEIGHT *water);
+
+	/** Gets the X position of the first cell of the grid in the loaded DEM (non zero after crop) */
+	inline unsigned getOriginX() { return originX; }
+
+	/** Gets the Y position of the first cell of the grid in the loaded DEM (non zero after crop) */
+	inline unsigned getOriginY() { return originY; }
+
+	/** Gets the number of land cells */
+	inline size_t getNumLandCells() { return numLandCells; }
 
 	/** Gets X dimention of the grid */
 	inline unsigned getDimX() { return dimX; }
@@ -86,42 +168,118 @@ public:
 	/** Gets Y dimention of the cells of the grid */
 	inline unsigned getCellDimY() { return cellDimY; }
 
+	/**Returns a cell of the grid */
+	inline Cell *getCell(unsigned x, unsigned y) {
+		return cells + (size_t)y * dimX + x;
+	}
+
+	/**Returns the position of a cell in the cells buffer */
+	inline size_t getCellIndex(Cell *cell) {
+		return (size_t)(cell - cells);
+	}
+
+	/**Gets the neighbour cell with the lowest ZW value*/
+	Cell *getLowerNeighbourCell(unsigned x, unsigned y);
+
+	/**Gets the neighbour cell with the lowest ZW value*/
+	inline Cell *getLowerNeighbourCell(Cell *cell) {
+		size_t i = (size_t)(cell - cells);
+		return getLowerNeighbourCell((unsigned)(i % dimX), (unsigned)(i / dimX));
+	}
+
+	/**Gets the neighbour cell where the water of x,y flows to: the lower neighbour cell if it is strictly
+	lower than x,y, breaking ties by the position in the cells buffer. Following these cells never loops.
+	Returns NULL for border cells, pits and flats*/
+	inline Cell *getDownstreamCell(unsigned x, unsigned y) {
+		Cell *cell = getCell(x, y), *lowerCell = getLowerNeighbourCell(x, y);
+		if (lowerCell && (lowerCell->getZW() < cell->getZW() || (lowerCell->getZW() == cell->getZW() && lowerCell < cell)))
+			return lowerCell;
+		return 0;
+	}
+
 private:
 
 	/** Grid dimentions */
 	unsigned dimX, dimY;
 	/** Cell dimentions */
 	unsigned cellDimX, cellDimY;
+	/** Position of the first cell in the loaded DEM */
+	unsigned originX, originY;
 	/** Cells buffer */
 	Cell *cells;
+	/** Runs of land cells (Z > 0), in raster order. The simulation passes only visit these cells */
+	std::vector<LandRun> landRuns;
+	/** Number of land cells */
+	size_t numLandCells;
+	/** Offsets of the 8 neighbours of a cell in the cells buffer */
+	int neighbourOffsets[8];
+	/** Slope factors of the 8 neighbours: 1 for edges, 1 / sqrt(2) for corners */
+	HEIGHT neighbourWeights[8];
 	/** FIFO of unprocessed cells*/
-	CircQueue<Cell *> processingCells;
-
-	/**Returns a cell of the grid */
-	inline Cell *getCell(unsigned x, unsigned y) {
-		return cells + y * dimX + x;
-	}
+	CircQueue<Cell *, LargeAllocator<Cell *> > processingCells;
+	/** Number of cells in the FIFO */
+	size_t numQueuedCells;
+	/** Number of tiles in each dimension */
+	unsigned numTilesX, numTilesY;
+	/** Tiles whose cells are not processed by fastWaterTransfer. Empty if tiles are not used */
+	std::vector<bool> frozenTiles;
+	/** Water sent or received by each tile in the current iteration */
+	std::vector<HEIGHT> tileTransfer;
+	/** Minimum transfer of a tile in an iteration to keep it active */
+	HEIGHT tileFreezeTransfer;
+	/** Cells of the frozen tiles that were waiting in the FIFO */
+	std::vector< std::vector<Cell *> > parkedCells;
+	/** Rows processed by fastWaterTransfer */
+	unsigned bandFirstRow, bandEndRow;
+	/** Water sent to the halo rows of the band */
+	std::vector<HEIGHT> bandOutflow;
+	/** Reductions of the last sweep */
+	SweepStats stats;
+	/** Indicates whether the W and DA values have not changed since the last sweep */
+	bool statsValid;
 
 	/**Devuelve la mayor cantidad de agua de las celdas vecinas a x,y pero sin
 	contar la celda vecina apuntada por x,y ni la celda vecina apuntada por esta*/
 	HEIGHT getMaxWNeigh( unsigned x, unsigned y );
 
 	/**Gets the maximum DA value of the DEM cells*/
-	HEIGHT getMaxDA();
+	inline HEIGHT getMaxDA() {
+		return statsValid ? stats.maxDA : sweep(SweepOps()).maxDA;
+	}
 
-	/**Gets the maximum Z value of the DEM cells*/
-	HEIGHT getMaxW();
+	/**Gets the maximum W value of the DEM cells*/
+	inline HEIGHT getMaxW() {
+		return statsValid ? stats.maxW : sweep(SweepOps()).maxW;
+	}
 
-	/**Gets the neighbour cell with the lowest ZW value*/
-	Cell *getLowerNeighbourCell(unsigned x, unsigned y);
 
-	/**Gets the neighbour cell with the lowest ZW value*/
-	inline Cell *getLowerNeighbourCell(Cell *cell) {
-		return getLowerNeighbourCell((unsigned)(cell - cells) % dimX, (unsigned)(cell - cells) / dimX);
-}
+	/** Inserts a cell in the FIFO of fastWaterTransfer */
+	inline void queueCell(Cell *cell) {
+		processingCells.push(cell);
+		++numQueuedCells;
+	}
+
+	/** Gets the tile of a cell */
+	inline unsigned getTile(Cell *cell) {
+		size_t i = (size_t)(cell - cells);
+		return (unsigned)((i / dimX) / TILE_SIZE * numTilesX + (i % dimX) / TILE_SIZE);
+	}
+
+	/** Unfreezes a tile, moving its parked cells back to the FIFO */
+	void wakeTile(unsigned tile);
+
+	/** Allocates the cells buffer for the current dimentions. Cells are initialized in parallel,
+	so that each page is placed close to the thread that processes it */
+	void allocateCells();
+
+	/** Builds the index of land cells and the neighbour table. Must be called after Z values change */
+	void buildLandIndex();
+
+	/** Fills the voids of the DEM by propagating inwards from their boundaries */
+	void fillVoids();
 
-/** Returns a Z value that is the average Z of the neighbour cells of x,y*/
-HEIGHT getNeighbourMeanZ(unsigned x, unsigned y);
+	/** Fills a void region. Its cells must be relabelled with the VOID_LABELLED Z value */
+	void fillVoidRegion(const size_t *regionCells, size_t numRegionCells);
 };
 
 #endif
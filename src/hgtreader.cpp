@@ -0,0 +1,216 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include "hgtreader.h"
+#include "trace.h"
+
+using namespace std;
+
+/** Signatures of the containers */
+#define GZIP_MAGIC 0x8b1f
+#define ZIP_LOCAL_HEADER 0x04034b50
+
+/** Compression methods of a zip entry */
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+//-----------------------------------------------------------------
+
+/** Reads a little-endian value of the given number of bytes */
+static unsigned readLE(ifstream &ifs, int bytes)
+{
+	unsigned char buffer[4];
+	ifs.read((char *)buffer, bytes);
+	if (ifs.gcount() != bytes)
+		throw runtime_error("truncated zip file");
+	unsigned value = 0;
+	for (int i = bytes - 1; i >= 0; --i)
+		value = (value << 8) | buffer[i];
+	return value;
+}
+
+//-----------------------------------------------------------------
+
+HGTReader::HGTReader(const char *filename) : freeChunks(HGT_CHUNKS), filledChunks(HGT_CHUNKS), current(0)
+{
+	ifs.exceptions(ifstream::failbit | ifstream::badbit);
+	ifs.open(filename, ifstream::binary);
+	// End of file is checked by the readers
+	ifs.exceptions(ifstream::badbit);
+
+	unsigned char magic[4] = { 0, 0, 0, 0 };
+	ifs.read((char *)magic, 4);
+	ifs.clear();
+	ifs.seekg(0);
+	unsigned signature = magic[0] | (magic[1] << 8) | (magic[2] << 16) | ((unsigned)magic[3] << 24);
+	if ((signature & 0xffff) == GZIP_MAGIC)
+		format = GZIP;
+	else if (signature == ZIP_LOCAL_HEADER)
+		format = ZIP;
+	else
+		format = RAW;
+
+	for (int i = 0; i < HGT_CHUNKS; ++i) {
+		chunks[i].data.resize(HGT_CHUNK_SIZE);
+		freeChunks.push(&chunks[i]);
+	}
+
+	reader = thread(&HGTReader::readChunks, this);
+}
+
+//-----------------------------------------------------------------
+
+HGTReader::~HGTReader()
+{
+	// The reader thread stops when it needs a free chunk
+	freeChunks.close();
+	reader.join();
+}
+
+//-----------------------------------------------------------------
+
+const unsigned char *HGTReader::next(size_t &bytes)
+{
+	if (current)
+		freeChunks.push(current);
+	current = 0;
+	if (!filledChunks.pop(current)) {
+		current = 0;
+		if (error != "")
+			throw runtime_error(error);
+		bytes = 0;
+		return 0;
+	}
+	bytes = current->size;
+	return &current->data[0];
+}
+
+//-----------------------------------------------------------------
+
+void HGTReader::readChunks()
+{
+	Trace::nameThread("hgt reader");
+	TraceSpan span("read chunks");
+	try {
+		if (format == GZIP)
+			// 16 selects the gzip header
+			inflateChunks(16 + MAX_WBITS);
+		else if (format == ZIP) {
+			unsigned long long size;
+			unsigned method = readZipHeader(size);
+			if (method == ZIP_STORED)
+				copyChunks(size);
+			else if (method == ZIP_DEFLATED)
+				// Negative window bits select a raw deflate stream
+				inflateChunks(-MAX_WBITS);
+			else
+				throw runtime_error("unsupported zip compression method");
+		}
+		else
+			copyChunks(~0ull);
+	} catch(std::exception &e) {
+		error = string("error reading HGT file: ") + e.what();
+	}
+	filledChunks.close();
+}
+
+//-----------------------------------------------------------------
+
+void HGTReader::copyChunks(unsigned long long size)
+{
+	Chunk *chunk;
+	while (size > 0 && freeChunks.pop(chunk)) {
+		ifs.read((char *)&chunk->data[0], (streamsize)min(size, (unsigned long long)chunk->data.size()));
+		chunk->size = (size_t)ifs.gcount();
+		size -= chunk->size;
+		if (chunk->size == 0) {
+			freeChunks.push(chunk);
+			return;
+		}
+		filledChunks.push(chunk);
+	}
+}
+
+//-----------------------------------------------------------------
+
+void HGTReader::inflateChunks(int windowBits)
+{
+	vector<unsigned char> input(HGT_CHUNK_SIZE);
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	stream.next_in = Z_NULL;
+	stream.avail_in = 0;
+	if (inflateInit2(&stream, windowBits) != Z_OK)
+		throw runtime_error("cannot initialize zlib");
+
+	int status = Z_OK;
+	bool inputEnded = false;
+	Chunk *chunk;
+	while (status != Z_STREAM_END && status != Z_BUF_ERROR && freeChunks.pop(chunk)) {
+		stream.next_out = &chunk->data[0];
+		stream.avail_out = (uInt)chunk->data.size();
+
+		// Chunks are filled up, so that only the last one may have an odd size. zlib may still hold
+		// output after using up the input, so the stream only ends with Z_STREAM_END or when inflate
+		// cannot progress (Z_BUF_ERROR) once the file has been read
+		while (stream.avail_out > 0 && status != Z_STREAM_END) {
+			if (stream.avail_in == 0 && !inputEnded) {
+				ifs.read((char *)&input[0], input.size());
+				stream.next_in = &input[0];
+				stream.avail_in = (uInt)ifs.gcount();
+				inputEnded = stream.avail_in == 0;
+			}
+			status = inflate(&stream, Z_NO_FLUSH);
+			if (status == Z_BUF_ERROR)
+				break;
+			if (status != Z_OK && status != Z_STREAM_END) {
+				inflateEnd(&stream);
+				throw runtime_error("corrupt compressed data");
+			}
+		}
+
+		chunk->size = chunk->data.size() - stream.avail_out;
+		if (chunk->size == 0) {
+			freeChunks.push(chunk);
+			break;
+		}
+		filledChunks.push(chunk);
+	}
+	inflateEnd(&stream);
+}
+
+//-----------------------------------------------------------------
+
+unsigned HGTReader::readZipHeader(unsigned long long &size)
+{
+	// Skips the directories and empty files at the beginning of the archive
+	while (readLE(ifs, 4) == ZIP_LOCAL_HEADER) {
+		readLE(ifs, 2);
+		unsigned flags = readLE(ifs, 2);
+		unsigned method = readLE(ifs, 2);
+		readLE(ifs, 4);
+		readLE(ifs, 4);
+		size = readLE(ifs, 4);
+		unsigned long long fileSize = readLE(ifs, 4);
+		unsigned nameLength = readLE(ifs, 2);
+		unsigned extraLength = readLE(ifs, 2);
+		string name(nameLength, ' ');
+		ifs.read(&name[0], nameLength);
+		ifs.ignore(extraLength);
+
+		// Sizes stored after the data (bit 3) are unknown here, but a deflate stream has its own end
+		bool sizesAfterData = (flags & 8) != 0;
+		if (sizesAfterData && method == ZIP_DEFLATED)
+			return method;
+		if (sizesAfterData)
+			throw runtime_error("unsupported zip entry");
+		if (fileSize > 0 && (name.empty() || name[name.size() - 1] != '/'))
+			return method;
+		ifs.ignore((streamsize)size);
+	}
+	throw runtime_error("no file in the zip archive");
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,97 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+#ifndef HGTREADER_H
+#define HGTREADER_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <zlib.h>
+
+#include "boundedqueue.h"
+
+/** Size of the chunks of samples delivered by HGTReader */
+#define HGT_CHUNK_SIZE (1 << 20)
+/** Number of chunks shared by the reader thread and the consumer */
+#define HGT_CHUNKS 3
+
+/** This class streams the samples of a HGT file (big-endian 16 bit heights in raster order), which
+may be raw, gzip compressed (.hgt.gz) or the first file of a zip archive (.hgt.zip). A background
+thread reads and inflates the file into chunks while the consumer converts the previous ones, so
+no temporary file is needed. The format is detected from the first bytes of the file */
+class HGTReader {
+
+public:
+	/** Formats of the file */
+	enum Format { RAW, GZIP, ZIP };
+
+	/** Opens the file and starts the reader thread. Throws an exception if the file cannot be opened */
+	HGTReader(const char *filename);
+
+	/** Destructor. Stops the reader thread */
+	~HGTReader();
+
+	/** Gets the next chunk of samples, valid until the following call. Returns NULL at the end of the
+	samples. Throws the error of the reader thread, if any.
+	\param bytes Returns the size of the chunk, which is even except for the last chunk */
+	const unsigned char *next(size_t &bytes);
+
+	/** Gets the format of the file */
+	inline Format getFormat() { return format; }
+
+private:
+	/** Chunk of samples */
+	struct Chunk {
+		std::vector<unsigned char> data;
+		size_t size;
+	};
+
+	std::ifstream ifs;
+	Format format;
+	/** Chunks and queues between the reader thread and the consumer */
+	Chunk chunks[HGT_CHUNKS];
+	BoundedQueue<Chunk *> freeChunks, filledChunks;
+	/** Chunk being converted by the consumer */
+	Chunk *current;
+	std::thread reader;
+	/** Error of the reader thread */
+	std::string error;
+
+	/** Body of the reader thread */
+	void readChunks();
+
+	/** Fills the chunks with the bytes of the file */
+	void copyChunks(unsigned long long size);
+
+	/** Fills the chunks with the inflated bytes of the file.
+	\param windowBits Parameter of inflateInit2 for the container of the stream */
+	void inflateChunks(int windowBits);
+
+	/** Reads the header of the first file of a zip archive, leaving the stream at its data.
+	\return The compression method. size returns the size of the data */
+	unsigned readZipHeader(unsigned long long &size);
+};
+
+#endif
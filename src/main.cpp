@@ -30,9 +30,29 @@
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <vector>
+#include <map>
 #include <cstdlib>
 #include <cmath>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <thread>
 #include "grid.h"
+#include "network.h"
+#include "basins.h"
+#include "pipeline.h"
+#include "scenarios.h"
+#include "snapshot.h"
+#include "domain.h"
+#include "flowindex.h"
+#include "roi.h"
+#include "raster.h"
+#include "pyramid.h"
+#include "async.h"
+#include "exact.h"
+#include "trace.h"
 
 #ifndef INFINITY
 	#include <limits>
@@ -50,6 +70,13 @@ using namespace std;
 #define FIRST_PASS_WATER 10000.0f
 #define FIRST_PASS_END_PERCENT 1.0f
 
+#define SNAPSHOT_INTERVAL 10
+
+/** Drainage engines */
+#define ENGINE_SYNC 0
+#define ENGINE_ASYNC 1
+#define ENGINE_EXACT 2
+
 
 //-----------------------------------------------------------------
 
@@ -57,10 +84,13 @@ int doDry(Grid &grid, bool verbose)
 {
 	float transfer = +INFINITY;
 	int n = 1;
+	TraceSpan span("fill", true);
 	if( verbose )
 		cout << "Iteration: ";
 	while (transfer > 1) {
+		TraceSpan iteration("fill iteration");
 		transfer = grid.dry();
+		span.addCells(grid.getNumLandCells());
 		if( !(n%10) && verbose ){
 			cout << n << " (" << transfer << ") ";
 			cout.flush();
@@ -72,44 +102,112 @@ int doDry(Grid &grid, bool verbose)
 
 //-----------------------------------------------------------------
 
-int doFastWaterTransfer(Grid &grid, float minTransfer, bool verbose)
+int doFastWaterTransfer(Grid &grid, float minTransfer, bool activeTiles, bool verbose, SnapshotWriter *snapshots = 0)
 {
-	grid.setupFastWaterTransfer();
+	grid.setupFastWaterTransfer(activeTiles ? minTransfer : 0.0f);
 	float transfer = +INFINITY;
 	int n = 1;
+	TraceSpan span("transfer", true);
 	if( verbose )
 		cout << "Iteration: ";
+	if( snapshots )
+		snapshots->capture(grid, 0);
 		
-	while (transfer > minTransfer && n<10000) {
+	while (transfer > minTransfer && n<10000 && grid.getNumQueuedCells() > 0) {
+		TraceSpan iteration("transfer iteration");
+		span.addCells(grid.getNumQueuedCells());
 		transfer = grid.fastWaterTransfer();
+		if( snapshots )
+			snapshots->capture(grid, n);
 		if( !(n%10) && verbose ){
 			cout << n << " (" << transfer << ") ";
 			cout.flush();
 		}
 		++n;
 	}    
+	if( snapshots )
+		snapshots->capture(grid, n - 1, true);
 	return n;
 }
 
 //-----------------------------------------------------------------
 
+/** Runs the iterations of all the scenarios until each one transfers less than its minimum.
+\param numIter Returns the number of iterations of each scenario */
+void doScenarioWaterTransfer(ScenarioGrid &scenarios, const float *minTransfer, int *numIter, bool verbose)
+{
+	HEIGHT transfer[MAX_SCENARIOS];
+	int numRunning = scenarios.getNumScenarios();
+	int n = 1;
+	if( verbose )
+		cout << "Iteration: ";
+
+	while (numRunning > 0 && n<10000) {
+		scenarios.waterTransfer(transfer);
+		for (int k = 0; k < scenarios.getNumScenarios(); ++k) {
+			// A scenario without queued cells stops as doFastWaterTransfer does
+			if (scenarios.isRunning(k) && (transfer[k] <= minTransfer[k] || scenarios.getNumQueuedCells(k) == 0)) {
+				scenarios.stopScenario(k);
+				numIter[k] = n + 1;
+				--numRunning;
+			}
+		}
+		if( !(n%10) && verbose ){
+			cout << n << " (" << numRunning << " running) ";
+			cout.flush();
+		}
+		++n;
+	}
+	for (int k = 0; k < scenarios.getNumScenarios(); ++k)
+		if (scenarios.isRunning(k))
+			numIter[k] = n;
+}
+
+//-----------------------------------------------------------------
+
 void printHelp( char *args )
 {
 	cout << "Usage:" << endl;
 	cout << "\t" << args << " FILE -x VALUE -y VALUE [parameters]" << endl;
+	cout << "\t" << args << " -b LIST -x VALUE -y VALUE [parameters]" << endl;
+	cout << "\t" << args << " -qi INDEX -q QUERIES [-v]" << endl;
 	cout << endl;
 	cout << "File:" << endl;
-	cout << "\t<s>:\tInput .hgt file" << endl;
+	cout << "\t<s>:\tInput .hgt file. It may also be gzip compressed (.hgt.gz) or the first file of a zip archive (.hgt.zip)." << endl;
 	cout << "Options:" << endl;
 	cout << "\t-x\tX dimension X of the DEM (mandatory)." << endl;
 	cout << "\t-y\tY dimension Y of the DEM (mandatory)." << endl;
-	cout << "\t-w\tDepth of the initial water layer W (in millimeters) assigned  to each cell." << endl;
+	cout << "\t-w\tDepth of the initial water layer W (in millimeters) assigned  to each cell. A comma separated list (up to " << MAX_SCENARIOS << " values) simulates each depth as a scenario in a single pass, and the name of every output file gets the suffix '_w' followed by the depth." << endl;
 	cout << "\t-da\tMinimum drainage accumulation value DA (in millimeters) for a cell belongs to the drainage network (meters)." << endl;
 	cout << "\t-s\t The algorithm stops once the water transferred in an iteration falls bellow this percentage of the total amount of water initially dropped on the DEM (percent 1-100)." << endl;
 	cout << "\t-o\t Output file containing the drainage network. Most image format are supported. '.ply' format is also supported." << endl;
 	cout << "\t-ow\t Output file containing the depth of the residual water layer W after the algorithm. If this parameter is not set, the data is not saved. Most image format are supported." << endl;
+	cout << "\t-on\t Output file containing the vector drainage network with its junctions and Strahler orders. '.geojson' and '.json' files are saved in GeoJSON format; otherwise a binary edge list is saved." << endl;
+	cout << "\t-ob\t Output file containing the basin label of each cell (32 bit labels in raster order after a 16 byte header)." << endl;
+	cout << "\t-obt\t Output CSV file containing the area, maximum DA and outlet of each basin." << endl;
+	cout << "\t-so\t Output file containing snapshots of the water layer W taken while the drainage is computed, written by a background thread as a compressed stream of delta encoded frames (.dsnp)." << endl;
+	cout << "\t-sn\t Number of iterations between two snapshots (10 by default)." << endl;
+	cout << "\t-sp\t Planes stored in the snapshots: 'w' (default), 'da' or 'wda'." << endl;
+	cout << "\t-e\t Drainage engine: 'sync' (default) processes the FIFO of cells in iterations; 'async' runs worker threads that steal cells from each other and transfer water without waiting for the end of an iteration, stopping when the water transferred by the cells of an epoch (the cells queued by the previous epoch, as in an iteration) falls below the -s threshold; 'exact' fills the DEM (as -f) and accumulates the water of every cell along the steepest descent paths in a single pass, draining the flats towards their edges." << endl;
+	cout << "\t-t\t Number of worker threads of the async engine (the number of cores by default)." << endl;
+	cout << "\t-np\t Number of worker processes. The DEM is split in horizontal bands, one per process, that exchange the water crossing their edges through shared memory every iteration." << endl;
+	cout << "\t-or\t Output file containing the values of the planes selected with -rp as raw float32 rasters (.raw), with a header and the values at offset " << RASTER_RAW_OFFSET << " so that they can be mapped directly. The name of each file gets the suffix of its plane ('_da', '_w', '_zw' or '_mask')." << endl;
+	cout << "\t-ot\t Output file containing the values of the planes selected with -rp as tiled GeoTIFF files (.tif), georeferenced if the input file is named after its corner (N37W004.hgt). The name of each file gets the suffix of its plane." << endl;
+	cout << "\t-rp\t Comma separated planes saved by -or and -ot: 'da' (default), 'w', 'zw' (filled DEM Z+W) and 'mask' (drainage network)." << endl;
+	cout << "\t-tc\t Deflate compression of the GeoTIFF files." << endl;
+	cout << "\t-op\t Output directory containing the drainage network as a pyramid of " << PYRAMID_TILE_SIZE << "x" << PYRAMID_TILE_SIZE << " tiles (DIRECTORY/z/x/y), from a pixel per cell at the highest zoom down to a single tile at zoom 0. Lower levels keep the maximum DA of the cells they cover." << endl;
+	cout << "\t-pf\t Format of the pyramid tiles: 'png' (default) or 'raw' (float32 DA values)." << endl;
+	cout << "\t-oi\t Output file containing the flow index (.fidx): the flow direction of each cell on the final Z+W surface, used to answer flow queries without running the simulation again." << endl;
+	cout << "\t-qi\t Input flow index saved with -oi. The queries are answered from the index and no DEM is processed." << endl;
+	cout << "\t-q\t Text file of flow queries, one per line: 'down X Y' prints the cells of the downstream path from cell (X, Y), 'up X Y' prints the number of cells and the area (square meters) that drain into it and 'upcells X Y' prints these cells." << endl;
+	cout << "\t-roi\t Region of interest: an outlet cell 'X,Y' or a rectangle of cells 'X0,Y0,X1,Y1'. Only the cells that drain into it on the filled DEM (and a margin around them) are simulated and saved; the other cells become sea. The outputs cover the bounding box of these cells, whose first cell is printed." << endl;
+	cout << "\t-rm\t Margin (in cells) kept around the catchment of the region of interest (" << ROI_MARGIN << " by default)." << endl;
+	cout << "\t-b\t Batch mode. Processes the .hgt files listed in this text file (one per line), overlapping the loading, computation and saving of consecutive tiles. Output files are named after each input file followed by '_' and the name given in the output parameters, and saved in the directory of those parameters. Input files with the same name get a counter after it ('_1', '_2', ...)." << endl;
 	cout << "\t-f\t Preprocess the terrain to fill the pits." << endl;
+	cout << "\t-at\t Active tiles. Regions of " << TILE_SIZE << "x" << TILE_SIZE << " cells that transfer little water are frozen until a neighbour sends water into them, so late iterations only process the regions still draining." << endl;
 	cout << "\t-v\t Verbose. Prints real-time status of the program." << endl;
+	cout << "\t-trace\t Saves the spans of the phases (loading, filling, transfer iterations, saving...) and of the work of the background threads to this file as Chrome trace events (JSON), to be opened with chrome://tracing or Perfetto." << endl;
+	cout << "\t-perf\t Reads the hardware performance counters (cycles, instructions, LLC, branch and dTLB misses) of the main thread and the OpenMP threads around the filling, the transfer and the other phases, and prints them with the cells processed per cycle at the end. Linux only; perf_event_paranoid must allow measuring the own process. Not supported with -b, whose overlapping phases would share the counters." << endl;
 	cout << "\t-h\t Shows this help and exits." << endl;
 	cout << endl;
 	cout << "2013 (c) Jose Maria Noguera and Antonio Rueda. University of Jaen." << endl << endl;
@@ -118,16 +216,43 @@ void printHelp( char *args )
 //-----------------------------------------------------------------
 
 typedef struct {
-	float endThreshold;
+	std::string file;
+	std::vector<std::string> batch;
+	unsigned dimX, dimY;
+	float stopPercent;
 	float DAThreshold;
 	float initW;
+	std::vector<float> scenarioW;
 	std::string outputW;
 	std::string outputDA;
+	std::string outputNetwork;
+	std::string outputBasins;
+	std::string outputBasinTable;
+	std::string outputSnapshots;
+	std::string outputRaw;
+	std::string outputGeoTIFF;
+	int rasterPlanes;
+	bool compressGeoTIFF;
+	std::string outputPyramid;
+	int pyramidFormat;
+	std::string outputIndex;
+	std::string inputIndex;
+	std::string queries;
+	int snapshotInterval;
+	int snapshotPlanes;
+	int numProcesses;
+	int engine;
+	int numThreads;
+	std::vector<unsigned> roi;
+	unsigned roiMargin;
 	bool fill;
+	bool activeTiles;
+	std::string outputTrace;
+	bool perf;
 	bool verbose;
 } Parameters;
 
-int init( int argc, char *argv[], Grid &grid, Parameters &param )
+int init( int argc, char *argv[], Parameters &param )
 {
 	if( argc < 2 ){
 		printHelp( argv[0] );
@@ -135,38 +260,73 @@ int init( int argc, char *argv[], Grid &grid, Parameters &param )
 	}
 
 	//default values
-	unsigned int x = 0;
-	unsigned int y = 0;
+	param.dimX = 0;
+	param.dimY = 0;
 	param.initW = INIT_WATER;
 	param.DAThreshold = DA_THRESHOLD;
-	float stopPercent = END_PERCENT;
+	param.stopPercent = END_PERCENT;
 	param.outputDA = "output_DA.png";
 	param.outputW = "";
+	param.outputNetwork = "";
+	param.outputBasins = "";
+	param.outputBasinTable = "";
+	param.outputSnapshots = "";
+	param.outputRaw = "";
+	param.outputGeoTIFF = "";
+	param.rasterPlanes = RASTER_DA;
+	param.compressGeoTIFF = false;
+	param.outputPyramid = "";
+	param.pyramidFormat = PYRAMID_PNG;
+	param.outputIndex = "";
+	param.inputIndex = "";
+	param.queries = "";
+	param.snapshotInterval = SNAPSHOT_INTERVAL;
+	param.snapshotPlanes = SNAPSHOT_W;
+	param.numProcesses = 1;
+	param.engine = ENGINE_SYNC;
+	param.numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+	param.roiMargin = ROI_MARGIN;
 	param.fill = false;
+	param.activeTiles = false;
+	param.outputTrace = "";
+	param.perf = false;
 	param.verbose = false;
 
-	//first argument is the name of the HGT file
-	std::string file = argv[1];
+	//first argument is the name of the HGT file, unless a batch is given
+	int i = 1;
+	if( argv[1][0] != '-' )
+		param.file = argv[i++];
 
-	for (int i = 2; i < argc; ++i) {
+	for (; i < argc; ++i) {
 
 		if (std::string(argv[i]) == "-x" ) {   
 			i++;
 			if( i < argc )
-				istringstream ( argv[i] ) >> x;
+				istringstream ( argv[i] ) >> param.dimX;
 		}
 
 		else if (std::string(argv[i]) == "-y" ) {
 			i++;
 			if( i < argc )
-				istringstream ( argv[i] ) >> y;
+				istringstream ( argv[i] ) >> param.dimY;
 		}
 
 		else if (std::string(argv[i]) == "-w" ) {
 			i++;
 			if( i < argc ){
-				istringstream ( argv[i] ) >> param.initW;
-				param.initW /= 1000.0;
+				istringstream values( argv[i] );
+				std::string value;
+				param.scenarioW.clear();
+				while( getline(values, value, ',') ){
+					float w = 0.0f;
+					istringstream ( value ) >> w;
+					param.scenarioW.push_back(w / 1000.0f);
+				}
+				if( param.scenarioW.empty() || param.scenarioW.size() > MAX_SCENARIOS ){
+					cout << "Error: -w accepts between 1 and " << MAX_SCENARIOS << " values" << endl;
+					return -1;
+				}
+				param.initW = param.scenarioW[0];
 			}	
 		}
 
@@ -181,8 +341,8 @@ int init( int argc, char *argv[], Grid &grid, Parameters &param )
 		else if (std::string(argv[i]) == "-s" ) {
 			i++;
 			if( i < argc ){
-				istringstream ( argv[i] ) >> stopPercent;
-				if( stopPercent < 0.f || stopPercent > 100.0 ){
+				istringstream ( argv[i] ) >> param.stopPercent;
+				if( param.stopPercent < 0.f || param.stopPercent > 100.0 ){
 					cout << "Error: -s parameter must be between 0 and 100" << endl;
 					return -1;
 				}
@@ -203,14 +363,253 @@ int init( int argc, char *argv[], Grid &grid, Parameters &param )
 			}	
 		}
 
+		else if (std::string(argv[i]) == "-on" ) {
+			i++;
+			if( i < argc ){
+				param.outputNetwork = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-ob" ) {
+			i++;
+			if( i < argc ){
+				param.outputBasins = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-obt" ) {
+			i++;
+			if( i < argc ){
+				param.outputBasinTable = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-so" ) {
+			i++;
+			if( i < argc ){
+				param.outputSnapshots = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-sn" ) {
+			i++;
+			if( i < argc ){
+				istringstream ( argv[i] ) >> param.snapshotInterval;
+				if( param.snapshotInterval < 1 ){
+					cout << "Error: -sn parameter must be at least 1" << endl;
+					return -1;
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-sp" ) {
+			i++;
+			if( i < argc ){
+				std::string planes = argv[i];
+				if( planes == "w" )
+					param.snapshotPlanes = SNAPSHOT_W;
+				else if( planes == "da" )
+					param.snapshotPlanes = SNAPSHOT_DA;
+				else if( planes == "wda" )
+					param.snapshotPlanes = SNAPSHOT_W | SNAPSHOT_DA;
+				else {
+					cout << "Error: -sp parameter must be w, da or wda" << endl;
+					return -1;
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-e" ) {
+			i++;
+			if( i < argc ){
+				std::string engine = argv[i];
+				if( engine == "sync" )
+					param.engine = ENGINE_SYNC;
+				else if( engine == "async" )
+					param.engine = ENGINE_ASYNC;
+				else if( engine == "exact" ){
+					param.engine = ENGINE_EXACT;
+					param.fill = true;
+				}
+				else {
+					cout << "Error: -e parameter must be sync, async or exact" << endl;
+					return -1;
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-t" ) {
+			i++;
+			if( i < argc ){
+				istringstream ( argv[i] ) >> param.numThreads;
+				if( param.numThreads < 1 ){
+					cout << "Error: -t parameter must be at least 1" << endl;
+					return -1;
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-np" ) {
+			i++;
+			if( i < argc ){
+				istringstream ( argv[i] ) >> param.numProcesses;
+				if( param.numProcesses < 1 || param.numProcesses > MAX_PROCESSES ){
+					cout << "Error: -np parameter must be between 1 and " << MAX_PROCESSES << endl;
+					return -1;
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-or" ) {
+			i++;
+			if( i < argc ){
+				param.outputRaw = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-ot" ) {
+			i++;
+			if( i < argc ){
+				param.outputGeoTIFF = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-rp" ) {
+			i++;
+			if( i < argc ){
+				istringstream values( argv[i] );
+				std::string value;
+				param.rasterPlanes = 0;
+				while( getline(values, value, ',') ){
+					if( value == "da" )
+						param.rasterPlanes |= RASTER_DA;
+					else if( value == "w" )
+						param.rasterPlanes |= RASTER_W;
+					else if( value == "zw" )
+						param.rasterPlanes |= RASTER_ZW;
+					else if( value == "mask" )
+						param.rasterPlanes |= RASTER_MASK;
+					else {
+						cout << "Error: -rp planes must be da, w, zw or mask" << endl;
+						return -1;
+					}
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-tc" ) {
+			param.compressGeoTIFF = true;
+		}
+
+		else if (std::string(argv[i]) == "-op" ) {
+			i++;
+			if( i < argc ){
+				param.outputPyramid = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-pf" ) {
+			i++;
+			if( i < argc ){
+				std::string format = argv[i];
+				if( format == "png" )
+					param.pyramidFormat = PYRAMID_PNG;
+				else if( format == "raw" )
+					param.pyramidFormat = PYRAMID_RAW;
+				else {
+					cout << "Error: -pf parameter must be png or raw" << endl;
+					return -1;
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-oi" ) {
+			i++;
+			if( i < argc ){
+				param.outputIndex = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-qi" ) {
+			i++;
+			if( i < argc ){
+				param.inputIndex = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-q" ) {
+			i++;
+			if( i < argc ){
+				param.queries = argv[i];
+			}
+		}
+
+		else if (std::string(argv[i]) == "-roi" ) {
+			i++;
+			if( i < argc ){
+				istringstream values( argv[i] );
+				std::string value;
+				param.roi.clear();
+				while( getline(values, value, ',') ){
+					unsigned position = 0;
+					istringstream ( value ) >> position;
+					param.roi.push_back(position);
+				}
+				if( param.roi.size() == 2 ){
+					param.roi.push_back(param.roi[0]);
+					param.roi.push_back(param.roi[1]);
+				}
+				if( param.roi.size() != 4 ){
+					cout << "Error: -roi parameter must be X,Y or X0,Y0,X1,Y1" << endl;
+					return -1;
+				}
+			}
+		}
+
+		else if (std::string(argv[i]) == "-rm" ) {
+			i++;
+			if( i < argc ){
+				istringstream ( argv[i] ) >> param.roiMargin;
+			}
+		}
+
+		else if (std::string(argv[i]) == "-b" ) {
+			i++;
+			if( i < argc ){
+				ifstream ifs( argv[i] );
+				std::string line;
+				while( getline(ifs, line) )
+					if( line != "" )
+						param.batch.push_back(line);
+				if( param.batch.empty() ){
+					cout << "Error: no input files in " << argv[i] << endl;
+					return -1;
+				}
+			}
+		}
+
 		else if (std::string(argv[i]) == "-f" ) {  
 			param.fill = true;
 		}
 
+		else if (std::string(argv[i]) == "-at" ) {
+			param.activeTiles = true;
+		}
+
 		else if (std::string(argv[i]) == "-v" ) {  
 			param.verbose = true;
 		}
 
+		else if (std::string(argv[i]) == "-trace" ) {
+			i++;
+			if( i < argc )
+				param.outputTrace = argv[i];
+		}
+
+		else if (std::string(argv[i]) == "-perf" ) {
+			param.perf = true;
+		}
+
 		else if (std::string(argv[i]) == "-h" ) {  
 			printHelp( argv[0] );
 			return -1;
@@ -221,30 +620,444 @@ int init( int argc, char *argv[], Grid &grid, Parameters &param )
         }
 	}
 
-	if( x == 0 || y == 0 ){
+	if( param.inputIndex != "" ){
+		if( param.queries == "" ){
+			cout << "Error: -qi requires a -q file of queries" << endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	if( param.queries != "" && (!param.batch.empty() || param.scenarioW.size() > 1) ){
+		cout << "Error: -q is not supported with -b or several -w values" << endl;
+		return -1;
+	}
+
+	if( param.dimX == 0 || param.dimY == 0 ){
 		cout << "Error: please, specify the -x and -y parameters" << endl;
 		return -1;
 	}
 
-	try {
-		grid.loadHGT(file.c_str(), x, y, 90, 90);
-	} catch(std::exception &e) {
-		cerr << "Error loading input DEM file." << endl;
-		cout << e.what() << endl;
+	if( param.scenarioW.size() > 1 && !param.batch.empty() ){
+		cout << "Error: several -w values are not supported in batch mode" << endl;
+		return -1;
+	}
+
+	if( param.scenarioW.size() > 1 && param.outputSnapshots != "" ){
+		cout << "Error: snapshots are not supported with several -w values" << endl;
+		return -1;
+	}
+
+	if( param.numProcesses > 1 && (!param.batch.empty() || param.scenarioW.size() > 1 || param.activeTiles || param.outputSnapshots != "") ){
+		cout << "Error: -np is not supported with -b, -at, -so or several -w values" << endl;
+		return -1;
+	}
+
+	if( !param.roi.empty() && !param.batch.empty() ){
+		cout << "Error: -roi is not supported in batch mode" << endl;
+		return -1;
+	}
+
+	if( param.perf && !param.batch.empty() ){
+		cout << "Error: -perf is not supported in batch mode" << endl;
+		return -1;
+	}
+
+	if( param.engine != ENGINE_SYNC && (param.scenarioW.size() > 1 || param.activeTiles || param.outputSnapshots != "" || param.numProcesses > 1) ){
+		cout << "Error: the async and exact engines are not supported with -at, -so, -np or several -w values" << endl;
+		return -1;
+	}
+
+	if( param.file == "" && param.batch.empty() ){
+		cout << "Error: please, specify an input file" << endl;
 		return -1;
 	}
-	param.endThreshold = stopPercent/100.0f * param.initW * grid.getDimX() * grid.getDimY();
-	//cout << "end threshold is: " << endThreshold << endl;
 	return 0;
 }
 
 //-----------------------------------------------------------------
 
-bool isPly( std::string file )
+float getEndThreshold( Grid &grid, const Parameters &param, float initW )
+{
+	// The cells outside the catchment of a region of interest do not receive water
+	size_t numCells = param.roi.empty() ? (size_t)grid.getDimX() * grid.getDimY() : grid.getNumLandCells();
+	return param.stopPercent/100.0f * initW * numCells;
+}
+
+//-----------------------------------------------------------------
+
+std::string getExtension( std::string file )
 {
 	std::string extension = file.substr(file.find_last_of(".") + 1);
 	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
-	return extension == "ply";
+	return extension;
+}
+
+bool isPly( std::string file )
+{
+	return getExtension(file) == "ply";
+}
+
+bool isGeoJSON( std::string file )
+{
+	return getExtension(file) == "geojson" || getExtension(file) == "json";
+}
+
+/** Inserts a suffix in a file name before its extension */
+std::string addSuffix( const std::string &file, const std::string &suffix )
+{
+	size_t dot = file.find_last_of(".");
+	if( dot == std::string::npos || file.find_first_of("/\\", dot) != std::string::npos )
+		return file + suffix;
+	return file.substr(0, dot) + suffix + file.substr(dot);
+}
+
+/** Name of an output file: the prefix is inserted before the file name, after its directory,
+and the suffix before its extension */
+std::string getOutputName( const std::string &file, const std::string &prefix, const std::string &suffix = "" )
+{
+	size_t name = file.find_last_of("/\\") + 1;
+	return file.substr(0, name) + prefix + addSuffix(file.substr(name), suffix);
+}
+
+//-----------------------------------------------------------------
+
+void fillDEM( Grid &grid, const Parameters &param )
+{
+	cout << "Filling DEM..." << endl;
+	grid.setW(FIRST_PASS_WATER);
+	int numIter = doDry( grid, param.verbose );
+	cout << endl << "Number of iterations: " << numIter << endl;
+}
+
+//-----------------------------------------------------------------
+
+/** Marks the network and computes the maximum DA and W used by the writers */
+void markResult( Grid &grid, const Parameters &param )
+{
+	TraceSpan span("mark result", true);
+	SweepOps result;
+	result.markResult = true;
+	result.daThreshold = param.DAThreshold;
+	grid.sweep(result);
+}
+
+//-----------------------------------------------------------------
+
+void computeDrainage( Grid &grid, const Parameters &param, const std::string &prefix )
+{
+	int numIter;
+
+	if( param.fill )
+		fillDEM( grid, param );
+
+	cout << "Computing drainage..." << endl;
+
+	{
+		TraceSpan span("setup", true);
+		SweepOps setup;
+		// The exact engine does not move the water, which stays as left by the filling
+		setup.addW = param.engine != ENGINE_EXACT;
+		setup.dw = param.initW;
+		setup.setDA = true;
+		setup.da = 0.0f;
+		grid.sweep(setup);
+	}
+
+	std::unique_ptr<SnapshotWriter> snapshots;
+	if( param.outputSnapshots != "" )
+		snapshots.reset(new SnapshotWriter(getOutputName(param.outputSnapshots, prefix).c_str(), grid.getDimX(), grid.getDimY(),
+			param.snapshotPlanes, param.snapshotInterval));
+
+	if( param.engine == ENGINE_EXACT ){
+		double start = getSeconds();
+		TraceSpan span("exact", true);
+		ExactAccumulation exact;
+		exact.run( grid, param.initW );
+		span.addCells((unsigned long long)grid.getDimX() * grid.getDimY());
+		numIter = 1;
+		if( param.verbose )
+			cout << "Exact engine: " << exact.getNumFlatCells() << " flat cells, " << exact.getNumSinks() << " sinks, "
+				<< (getSeconds() - start) * 1000.0 << " ms";
+	}
+	else if( param.engine == ENGINE_ASYNC ){
+		double start = getSeconds();
+		TraceSpan span("transfer", true);
+		AsyncWaterTransfer async( param.numThreads );
+		numIter = async.run( grid, getEndThreshold(grid, param, param.initW), param.verbose );
+		span.addCells(async.getNumProcessed());
+		if( param.verbose )
+			cout << endl << "Async engine: " << async.getNumProcessed() << " cells processed ("
+				<< async.getNumProcessed() / (getSeconds() - start) << " per second), " << async.getNumStolen() << " stolen";
+	}
+	else if( param.numProcesses > 1 ){
+		// The counters only see the parent process, which merges the bands
+		TraceSpan span("transfer", true);
+		numIter = DomainDecomposition(param.numProcesses).run( grid, getEndThreshold(grid, param, param.initW), param.verbose );
+	}
+	else
+		numIter = doFastWaterTransfer( grid, getEndThreshold(grid, param, param.initW), param.activeTiles, param.verbose, snapshots.get() );
+
+	if( snapshots ){
+		snapshots->finish();
+		if( param.verbose )
+			cout << endl << "Snapshots: " << snapshots->getNumFrames() << " frames (" << snapshots->getNumDropped() << " dropped), "
+				<< snapshots->getBytes() / (1 << 20) << " MB, " << snapshots->getCaptureSeconds() * 1000.0 << " ms capturing";
+	}
+
+	markResult( grid, param );
+
+	cout << endl << "Number of iterations: " << numIter << endl;
+}
+
+//-----------------------------------------------------------------
+
+/** Saves the planes selected with -rp as raw and/or GeoTIFF rasters */
+void saveRasters( Grid &grid, const Parameters &param, const std::string &input, const std::string &prefix, const std::string &suffix )
+{
+	const int planes[4] = { RASTER_DA, RASTER_W, RASTER_ZW, RASTER_MASK };
+	const char *planeSuffixes[4] = { "_da", "_w", "_zw", "_mask" };
+
+	RasterWriter writer( grid, input, param.dimX, param.dimY );
+	double start = getSeconds();
+	for (int k = 0; k < 4; ++k) {
+		if( !(param.rasterPlanes & planes[k]) )
+			continue;
+		if( param.outputRaw != "" )
+			writer.saveRaw( getOutputName(param.outputRaw, prefix, suffix + planeSuffixes[k]).c_str(), planes[k] );
+		if( param.outputGeoTIFF != "" )
+			writer.saveGeoTIFF( getOutputName(param.outputGeoTIFF, prefix, suffix + planeSuffixes[k]).c_str(), planes[k], param.compressGeoTIFF );
+	}
+	if( param.verbose )
+		cout << "Rasters saved in " << (getSeconds() - start) * 1000.0 << " ms" << (writer.getGeoReference().valid ? "" : " (not georeferenced)") << endl;
+}
+
+//-----------------------------------------------------------------
+
+void saveOutputs( Grid &grid, const Parameters &param, const std::string &input, const std::string &prefix, const std::string &suffix = "" )
+{
+	std::string outputDA = getOutputName(param.outputDA, prefix, suffix);
+
+	{
+		TraceSpan span("save DA", true);
+		if( isPly(outputDA) )
+			grid.savePLY( outputDA.c_str() );
+		else if( !grid.saveImageDA(outputDA.c_str()) ){
+			cout << "Error saving DA image: " << outputDA << "." << endl;
+		}
+	}
+
+	if( param.outputW != "" ){
+		TraceSpan span("save W", true);
+		std::string outputW = getOutputName(param.outputW, prefix, suffix);
+		if( !grid.saveImageW( outputW.c_str()) )
+			cout << "Error saving W image: " << outputW << "." << endl;
+	}
+
+	if( param.outputNetwork != "" ){
+		TraceSpan span("save network", true);
+		std::string outputNetwork = getOutputName(param.outputNetwork, prefix, suffix);
+		DrainageNetwork network;
+		network.extract(grid);
+		if( isGeoJSON(outputNetwork) )
+			network.saveGeoJSON(outputNetwork.c_str());
+		else
+			network.saveBinary(outputNetwork.c_str());
+		if( param.verbose )
+			cout << "Network: " << network.getNumNodes() << " nodes, " << network.getNumSegments() << " segments" << endl;
+	}
+
+	if( param.outputBasins != "" || param.outputBasinTable != "" ){
+		TraceSpan span("save basins", true);
+		Basins basins;
+		basins.label(grid);
+		if( param.outputBasins != "" )
+			basins.saveLabels(getOutputName(param.outputBasins, prefix, suffix).c_str());
+		if( param.outputBasinTable != "" )
+			basins.saveTable(getOutputName(param.outputBasinTable, prefix, suffix).c_str());
+		if( param.verbose )
+			cout << "Basins: " << basins.getNumBasins() << endl;
+	}
+
+	if( param.outputRaw != "" || param.outputGeoTIFF != "" ){
+		TraceSpan span("save rasters", true);
+		saveRasters( grid, param, input, prefix, suffix );
+	}
+
+	if( param.outputPyramid != "" ){
+		double start = getSeconds();
+		TraceSpan span("save pyramid", true);
+		TilePyramid pyramid;
+		pyramid.build(grid);
+		pyramid.save(getOutputName(param.outputPyramid, prefix, suffix).c_str(), param.pyramidFormat);
+		if( param.verbose )
+			cout << "Pyramid: " << pyramid.getNumLevels() << " levels, " << pyramid.getNumTiles() << " tiles in "
+				<< (getSeconds() - start) * 1000.0 << " ms" << endl;
+	}
+
+	if( param.outputIndex != "" ){
+		TraceSpan span("save index", true);
+		FlowIndex index;
+		index.build(grid);
+		index.save(getOutputName(param.outputIndex, prefix, suffix).c_str());
+	}
+}
+
+//-----------------------------------------------------------------
+
+/** Answers the queries of a text file with the flow index and prints the results */
+void runQueries( FlowIndex &index, const Parameters &param )
+{
+	ifstream ifs( param.queries.c_str() );
+	if( !ifs )
+		throw std::runtime_error("cannot open the queries file " + param.queries);
+
+	std::vector<size_t> cells;
+	std::string line;
+	size_t numQueries = 0;
+	ostringstream results;
+	double start = getSeconds();
+	TraceSpan span("queries", true);
+	while( getline(ifs, line) ){
+		istringstream fields( line );
+		std::string query;
+		long x = -1, y = -1;
+		if( !(fields >> query) )
+			continue;
+		fields >> x >> y;
+		results << line << ":";
+		if( x < 0 || y < 0 || x >= (long)index.getDimX() || y >= (long)index.getDimY() )
+			results << " error, the cell is outside the grid";
+		else if( query == "down" ){
+			index.getPath((unsigned)x, (unsigned)y, cells);
+			for (size_t k = 0; k < cells.size(); ++k)
+				results << " " << cells[k] % index.getDimX() << "," << cells[k] / index.getDimX();
+		}
+		else if( query == "up" )
+			results << " " << index.getUpstreamCount((unsigned)x, (unsigned)y) << " cells, "
+				<< index.getUpstreamArea((unsigned)x, (unsigned)y) << " m2";
+		else if( query == "upcells" ){
+			index.getUpstreamCells((unsigned)x, (unsigned)y, cells);
+			for (size_t k = 0; k < cells.size(); ++k)
+				results << " " << cells[k] % index.getDimX() << "," << cells[k] / index.getDimX();
+		}
+		else
+			results << " error, unknown query " << query;
+		results << "\n";
+		++numQueries;
+	}
+	span.addCells(numQueries);
+	double seconds = getSeconds() - start;
+
+	cout << results.str();
+	if( param.verbose )
+		cout << "Queries: " << numQueries << " in " << seconds * 1000.0 << " ms ("
+			<< (seconds > 0.0 ? numQueries / seconds : 0.0) << " queries per second)" << endl;
+}
+
+//-----------------------------------------------------------------
+
+/** Simulates the depths of the -w list as scenarios of a single pass and saves the outputs of each one */
+void computeScenarios( Grid &grid, const Parameters &param )
+{
+	if( param.fill )
+		fillDEM( grid, param );
+
+	cout << "Computing drainage of " << param.scenarioW.size() << " scenarios..." << endl;
+
+	ScenarioGrid scenarios;
+	scenarios.setup(grid, param.scenarioW);
+
+	float minTransfer[MAX_SCENARIOS];
+	int numIter[MAX_SCENARIOS];
+	for (size_t k = 0; k < param.scenarioW.size(); ++k)
+		minTransfer[k] = getEndThreshold(grid, param, param.scenarioW[k]);
+	doScenarioWaterTransfer( scenarios, minTransfer, numIter, param.verbose );
+	cout << endl;
+
+	for (size_t k = 0; k < param.scenarioW.size(); ++k) {
+		ostringstream suffix;
+		suffix << "_w" << param.scenarioW[k] * 1000.0f;
+		cout << "Scenario " << suffix.str().substr(1) << ": " << numIter[k] << " iterations" << endl;
+
+		scenarios.exportScenario((int)k, grid);
+		markResult( grid, param );
+		saveOutputs( grid, param, param.file, "", suffix.str() );
+	}
+}
+
+//-----------------------------------------------------------------
+
+/** Prefix of the output files of a tile in batch mode: the name of the input file without extension */
+std::string getBatchPrefix( const std::string &input )
+{
+	std::string name = input.substr(input.find_last_of("/\\") + 1);
+	return name.substr(0, name.find_first_of("."));
+}
+
+//-----------------------------------------------------------------
+
+/** Prefixes of the output files of the tiles in batch mode. Inputs from different directories
+with the same name get a counter after the name, so that their outputs do not overwrite each other */
+std::map<std::string, std::string> getBatchPrefixes( const std::vector<std::string> &inputs )
+{
+	// Distinct inputs in order, and how many of them share each name
+	std::map<std::string, std::string> prefixes;
+	std::vector<std::string> names, distinct;
+	std::map<std::string, int> numInputs;
+	for (size_t i = 0; i < inputs.size(); ++i)
+		if (prefixes.insert(std::make_pair(inputs[i], std::string())).second) {
+			distinct.push_back(inputs[i]);
+			names.push_back(getBatchPrefix(inputs[i]));
+			++numInputs[names.back()];
+		}
+
+	std::map<std::string, int> counters;
+	for (size_t i = 0; i < distinct.size(); ++i) {
+		std::string prefix = names[i];
+		if (numInputs[names[i]] > 1) {
+			do
+				prefix = names[i] + "_" + std::to_string(++counters[names[i]]);
+			while (numInputs.count(prefix));
+		}
+		prefixes[distinct[i]] = prefix + "_";
+	}
+	return prefixes;
+}
+
+//-----------------------------------------------------------------
+
+int runBatch( Parameters &param )
+{
+	std::map<std::string, std::string> prefixes = getBatchPrefixes(param.batch);
+	TilePipeline pipeline(
+		[&param](Grid &grid, const std::string &input) {
+			grid.loadHGT(input.c_str(), param.dimX, param.dimY, 90, 90);
+		},
+		[&param, &prefixes](Grid &grid, const std::string &input) {
+			cout << "Tile " << input << endl;
+			computeDrainage(grid, param, prefixes.at(input));
+		},
+		[&param, &prefixes](Grid &grid, const std::string &input) {
+			saveOutputs(grid, param, input, prefixes.at(input));
+		});
+
+	int numErrors = pipeline.run(param.batch);
+	cout << param.batch.size() - numErrors << " of " << param.batch.size() << " tiles processed." << endl;
+	return numErrors ? 1 : 0;
+}
+
+//-----------------------------------------------------------------
+
+/** Saves the trace and prints the performance counters, if enabled */
+void finishInstrumentation()
+{
+	try {
+		Trace::save();
+	} catch(std::exception &e) {
+		cout << "Error saving the trace: " << e.what() << endl;
+	}
+	PerfCounters::report(cout);
 }
 
 //-----------------------------------------------------------------
@@ -257,44 +1070,97 @@ int main(int argc, char *argv[])
 
 	Grid grid;
 	Parameters param;
-	int numIter;
 
 	cout << endl;
 
-	if( init( argc, argv, grid, param ) == -1 ){
+	if( init( argc, argv, param ) == -1 ){
 		exit(1);
 	}
 
-	if( param.fill ){
-		cout << "Filling DEM..." << endl;
-		grid.setW(FIRST_PASS_WATER);
-		numIter = doDry( grid, param.verbose );
-		cout << endl << "Number of iterations: " << numIter << endl;
+	if( param.outputTrace != "" ){
+		Trace::enable(param.outputTrace);
+		Trace::nameThread("main");
+	}
+	if( param.perf ){
+		std::string error;
+		if( !PerfCounters::enable(error) )
+			cout << "Performance counters not available: " << error << endl;
 	}
 
-	cout << "Computing drainage..." << endl;
-
-	grid.addW(param.initW);
-	grid.setDA(0);
-	numIter = doFastWaterTransfer( grid, param.endThreshold, param.verbose );
-	grid.markAsResultDAOver(param.DAThreshold);
+	if( !param.batch.empty() ){
+		int result = runBatch( param );
+		finishInstrumentation();
+		return result;
+	}
 
-	cout << endl << "Number of iterations: " << numIter << endl;
+	if( param.inputIndex != "" ){
+		try {
+			FlowIndex index;
+			index.load(param.inputIndex.c_str());
+			runQueries( index, param );
+		} catch(std::exception &e) {
+			cout << "Error answering the queries: " << e.what() << endl;
+			return 1;
+		}
+		finishInstrumentation();
+		return 0;
+	}
 
 	try {
-		if( isPly(param.outputDA) )
-			grid.savePLY( param.outputDA.c_str() );
-		else if( !grid.saveImageDA(param.outputDA.c_str()) ){
-			cout << "Error saving DA image: " << param.outputDA << "." << endl;
+		double start = getSeconds();
+		TraceSpan span("load", true);
+		grid.loadHGT(param.file.c_str(), param.dimX, param.dimY, 90, 90);
+		span.addCells((unsigned long long)param.dimX * param.dimY);
+		if( param.verbose )
+			cout << "DEM loaded in " << (getSeconds() - start) * 1000.0 << " ms" << endl;
+	} catch(std::exception &e) {
+		cerr << "Error loading input DEM file." << endl;
+		cout << e.what() << endl;
+		exit(1);
+	}
+
+	if( !param.roi.empty() ){
+		try {
+			double start = getSeconds();
+			TraceSpan span("region of interest", true);
+			RegionOfInterest roi;
+			roi.find(grid, min(param.roi[0], param.roi[2]), min(param.roi[1], param.roi[3]),
+				max(param.roi[0], param.roi[2]), max(param.roi[1], param.roi[3]), param.roiMargin);
+			roi.apply(grid);
+			cout << "Region of interest: " << roi.getDimX() << "x" << roi.getDimY() << " cells from cell "
+				<< roi.getFirstX() << "," << roi.getFirstY() << ", " << roi.getNumCatchmentCells() << " cells in the catchment, "
+				<< roi.getNumKeptCells() << " simulated" << endl;
+			if( param.verbose )
+				cout << "Region of interest found in " << (getSeconds() - start) * 1000.0 << " ms" << endl;
+		} catch(std::exception &e) {
+			cout << "Error: " << e.what() << endl;
+			exit(1);
 		}
+	}
 
-		if( param.outputW != "" ){
-			if( !grid.saveImageW( param.outputW.c_str()) )
-				cout << "Error saving W image: " << param.outputW << "." << endl;
+	if( param.verbose ){
+		LargeAllocStats alloc = getLargeAllocStats();
+		cout << "Grid memory: " << alloc.bytes / (1 << 20) << " MB in " << alloc.numAllocs << " buffers, "
+			<< alloc.seconds * 1000.0 << " ms to allocate and initialize, "
+			<< getHugePageBytes() / (1 << 20) << " MB on huge pages" << endl;
+	}
+
+	try {
+		if( param.scenarioW.size() > 1 )
+			computeScenarios( grid, param );
+		else {
+			computeDrainage( grid, param, "" );
+			saveOutputs( grid, param, param.file, "" );
+			if( param.queries != "" ){
+				FlowIndex index;
+				index.build(grid);
+				runQueries( index, param );
+			}
 		}
 	} catch(std::exception &e) {
 		cout << "Error saving image: " << e.what() << endl;
 		return 1;
 	}
+	finishInstrumentation();
 	return 0;
 }
@@ -0,0 +1,124 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <mutex>
+#include <chrono>
+
+#ifdef __linux__
+	#include <sys/mman.h>
+#else
+	#include <cstdlib>
+	#ifdef _WIN32
+		#include <malloc.h>
+	#endif
+#endif
+
+#include "memory.h"
+
+using namespace std;
+
+static LargeAllocStats stats = { 0, 0, 0.0 };
+static mutex statsMutex;
+
+//-----------------------------------------------------------------
+
+double getSeconds()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//-----------------------------------------------------------------
+
+void *allocLarge(size_t bytes)
+{
+	double start = getSeconds();
+	void *buffer;
+
+	if (bytes == 0)
+		bytes = 1;
+
+#ifdef __linux__
+	// Map an extra huge page and trim the mapping to an aligned address
+	size_t size = (bytes + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+	char *mapping = (char *)mmap(0, size + LARGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		throw std::bad_alloc();
+
+	char *aligned = (char *)(((size_t)mapping + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE);
+	if (aligned > mapping)
+		munmap(mapping, aligned - mapping);
+	munmap(aligned + size, mapping + LARGE_PAGE_SIZE - aligned);
+	#ifdef MADV_HUGEPAGE
+		madvise(aligned, size, MADV_HUGEPAGE);
+	#endif
+	buffer = aligned;
+#elif defined(_WIN32)
+	buffer = _aligned_malloc(bytes, LARGE_PAGE_SIZE);
+	if (!buffer)
+		throw std::bad_alloc();
+#else
+	if (posix_memalign(&buffer, LARGE_PAGE_SIZE, bytes))
+		throw std::bad_alloc();
+#endif
+
+	lock_guard<mutex> lock(statsMutex);
+	++stats.numAllocs;
+	stats.bytes += bytes;
+	stats.seconds += getSeconds() - start;
+	return buffer;
+}
+
+//-----------------------------------------------------------------
+
+void freeLarge(void *buffer, size_t bytes)
+{
+	if (!buffer)
+		return;
+	if (bytes == 0)
+		bytes = 1;
+#ifdef __linux__
+	munmap(buffer, (bytes + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE);
+#elif defined(_WIN32)
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+
+	lock_guard<mutex> lock(statsMutex);
+	--stats.numAllocs;
+	stats.bytes -= bytes;
+}
+
+//-----------------------------------------------------------------
+
+LargeAllocStats getLargeAllocStats()
+{
+	lock_guard<mutex> lock(statsMutex);
+	return stats;
+}
+
+//-----------------------------------------------------------------
+
+void addLargeInitTime(double seconds)
+{
+	lock_guard<mutex> lock(statsMutex);
+	stats.seconds += seconds;
+}
+
+//-----------------------------------------------------------------
+
+size_t getHugePageBytes()
+{
+	ifstream ifs("/proc/self/smaps_rollup");
+	string line;
+	while (getline(ifs, line)) {
+		if (line.compare(0, 14, "AnonHugePages:") == 0) {
+			size_t kb = 0;
+			istringstream(line.substr(14)) >> kb;
+			return kb * 1024;
+		}
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,84 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <cstddef>
+#include <new>
+
+/** Alignment of the large buffers: the size of a transparent huge page */
+#define LARGE_PAGE_SIZE ((size_t)2 << 20)
+
+/** Allocates a buffer aligned to LARGE_PAGE_SIZE and asks the system to back it with huge
+pages where available. Pages are not touched, so they are placed on the NUMA node of the
+thread that first writes them. Throws std::bad_alloc on failure */
+void *allocLarge(size_t bytes);
+
+/** Frees a buffer returned by allocLarge */
+void freeLarge(void *buffer, size_t bytes);
+
+/** Statistics of the large buffers allocated by the process */
+struct LargeAllocStats {
+	/** Number of buffers currently allocated */
+	size_t numAllocs;
+	/** Bytes currently allocated */
+	size_t bytes;
+	/** Total time spent allocating and initializing the buffers (seconds) */
+	double seconds;
+};
+
+/** Gets the statistics of the large buffers. Initialization time is added by the callers
+through addLargeInitTime */
+LargeAllocStats getLargeAllocStats();
+
+/** Adds the time spent initializing a large buffer to the statistics */
+void addLargeInitTime(double seconds);
+
+/** Gets the bytes of the process backed by transparent huge pages, or 0 if unknown */
+size_t getHugePageBytes();
+
+/** Gets the current time in seconds */
+double getSeconds();
+
+/** STL allocator for large buffers */
+template<typename T>
+class LargeAllocator {
+public:
+	typedef T value_type;
+
+	LargeAllocator() {}
+	template<typename U> LargeAllocator(const LargeAllocator<U> &) {}
+
+	T *allocate(size_t n) {
+		return (T *)allocLarge(n * sizeof(T));
+	}
+
+	void deallocate(T *p, size_t n) {
+		freeLarge(p, n * sizeof(T));
+	}
+
+	template<typename U> bool operator==(const LargeAllocator<U> &) const { return true; }
+	template<typename U> bool operator!=(const LargeAllocator<U> &) const { return false; }
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#include "network.h"
+
+using namespace std;
+
+#define NO_CELL ((size_t)-1)
+
+/** Size of the buffer of the output streams */
+#define NETWORK_BUFFER_SIZE (1 << 20)
+
+//-----------------------------------------------------------------
+
+/** Orders result cells (given by their positions in the compact index) from upstream to
+downstream: decreasing ZW, ties broken by position as in Grid::getDownstreamCell */
+struct UpstreamFirst {
+	Grid &grid;
+	const vector<size_t> &resultCells;
+	UpstreamFirst(Grid &grid, const vector<size_t> &resultCells) : grid(grid), resultCells(resultCells) {}
+	bool operator()(size_t i, size_t j) const {
+		size_t a = resultCells[i], b = resultCells[j];
+		Cell *cellA = grid.getCell(a % grid.getDimX(), a / grid.getDimX());
+		Cell *cellB = grid.getCell(b % grid.getDimX(), b / grid.getDimX());
+		return cellA->getZW() > cellB->getZW() || (cellA->getZW() == cellB->getZW() && a > b);
+	}
+};
+
+//-----------------------------------------------------------------
+
+void DrainageNetwork::extract(Grid &grid)
+{
+	dimX = grid.getDimX();
+	dimY = grid.getDimY();
+	cellDimX = grid.getCellDimX();
+	cellDimY = grid.getCellDimY();
+	nodes.clear();
+	segments.clear();
+	points.clear();
+
+	// The network is a small fraction of the grid, so it is handled with a compact
+	// index of the result cells in raster order
+	vector<size_t> resultCells;
+	for (unsigned int r = 0; r < dimY; ++r)
+		for (unsigned int c = 0; c < dimX; ++c)
+			if (grid.getCell(c, r)->isInResult())
+				resultCells.push_back((size_t)r * dimX + c);
+
+	size_t numResult = resultCells.size();
+	vector<size_t> down(numResult, NO_CELL);
+
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t i = 0; i < (ptrdiff_t)numResult; ++i) {
+		Cell *downCell = grid.getDownstreamCell(resultCells[i] % dimX, resultCells[i] / dimX);
+		if (downCell && downCell->isInResult())
+			down[i] = lower_bound(resultCells.begin(), resultCells.end(), grid.getCellIndex(downCell)) - resultCells.begin();
+	}
+
+	vector<unsigned char> inDegree(numResult, 0);
+	for (size_t i = 0; i < numResult; ++i)
+		if (down[i] != NO_CELL)
+			++inDegree[down[i]];
+
+	// Sources and junctions are the heads of the segments. Junctions without
+	// a downstream cell are outlets
+	vector<size_t> nodeOf(numResult, NO_CELL);
+	vector<size_t> heads;
+	for (size_t i = 0; i < numResult; ++i) {
+		if (inDegree[i] > 1 || (inDegree[i] == 0 && down[i] != NO_CELL)) {
+			NetworkNode node;
+			node.x = resultCells[i] % dimX;
+			node.y = resultCells[i] / dimX;
+			if (down[i] == NO_CELL)
+				node.type = NetworkNode::OUTLET;
+			else
+				node.type = inDegree[i] == 0 ? NetworkNode::SOURCE : NetworkNode::JUNCTION;
+			nodeOf[i] = nodes.size();
+			nodes.push_back(node);
+			if (down[i] != NO_CELL)
+				heads.push_back(i);
+		}
+	}
+
+	// Process the segments from upstream to downstream, so that the Strahler order
+	// of every segment reaching a junction is known before leaving it
+	sort(heads.begin(), heads.end(), UpstreamFirst(grid, resultCells));
+	// Maximum order of the segments reaching each node and number of them with that order
+	vector<unsigned> maxOrder(nodes.size(), 0), numMaxOrder(nodes.size(), 0);
+
+	for (size_t h = 0; h < heads.size(); ++h) {
+		NetworkSegment segment;
+		size_t i = heads[h];
+
+		segment.from = nodeOf[i];
+		segment.firstPoint = points.size();
+		segment.maxDA = 0.0f;
+		if (nodes[segment.from].type == NetworkNode::SOURCE)
+			segment.order = 1;
+		else
+			segment.order = maxOrder[segment.from] + (numMaxOrder[segment.from] > 1 ? 1 : 0);
+
+		while (true) {
+			points.push_back(resultCells[i]);
+			if (i != heads[h] && nodeOf[i] != NO_CELL && nodes[nodeOf[i]].type == NetworkNode::JUNCTION) {
+				// The DA of a junction belongs to the next segment
+				segment.to = nodeOf[i];
+				break;
+			}
+			segment.maxDA = max(segment.maxDA, grid.getCell(resultCells[i] % dimX, resultCells[i] / dimX)->getDA());
+			if (down[i] == NO_CELL) {
+				if (nodeOf[i] == NO_CELL) {
+					NetworkNode node;
+					node.x = resultCells[i] % dimX;
+					node.y = resultCells[i] / dimX;
+					node.type = NetworkNode::OUTLET;
+					nodeOf[i] = nodes.size();
+					nodes.push_back(node);
+					maxOrder.push_back(0);
+					numMaxOrder.push_back(0);
+				}
+				segment.to = nodeOf[i];
+				break;
+			}
+			i = down[i];
+		}
+		segment.numPoints = points.size() - segment.firstPoint;
+
+		if (segment.order > maxOrder[segment.to]) {
+			maxOrder[segment.to] = segment.order;
+			numMaxOrder[segment.to] = 1;
+		}
+		else if (segment.order == maxOrder[segment.to])
+			++numMaxOrder[segment.to];
+
+		segments.push_back(segment);
+	}
+}
+
+//-----------------------------------------------------------------
+
+void DrainageNetwork::saveGeoJSON(const char *filename)
+{
+	vector<char> buffer(NETWORK_BUFFER_SIZE);
+	ofstream ofs;
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	ofs.open(filename);
+
+	static const char *nodeTypes[] = { "source", "junction", "outlet" };
+
+	ofs << "{\"type\":\"FeatureCollection\",\"features\":[" << endl;
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		ofs << "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":["
+			<< nodes[n].x * cellDimX << "," << (dimY - 1 - nodes[n].y) * cellDimY << "]},"
+			<< "\"properties\":{\"node\":" << n << ",\"type\":\"" << nodeTypes[nodes[n].type] << "\"}},\n";
+	}
+	for (size_t s = 0; s < segments.size(); ++s) {
+		const NetworkSegment &segment = segments[s];
+		ofs << "{\"type\":\"Feature\",\"geometry\":{\"type\":\"LineString\",\"coordinates\":[";
+		for (size_t p = 0; p < segment.numPoints; ++p) {
+			size_t cell = points[segment.firstPoint + p];
+			ofs << (p ? ",[" : "[") << (cell % dimX) * cellDimX << "," << (dimY - 1 - cell / dimX) * cellDimY << "]";
+		}
+		ofs << "]},\"properties\":{\"segment\":" << s << ",\"from\":" << segment.from << ",\"to\":" << segment.to
+			<< ",\"order\":" << segment.order << ",\"maxDA\":" << segment.maxDA << "}}"
+			<< (s + 1 < segments.size() ? ",\n" : "\n");
+	}
+	ofs << "]}" << endl;
+}
+
+//-----------------------------------------------------------------
+
+static inline void writeUInt(ofstream &ofs, unsigned value)
+{
+	ofs.write((const char *)&value, sizeof(value));
+}
+
+static inline void writeUInt64(ofstream &ofs, unsigned long long value)
+{
+	ofs.write((const char *)&value, sizeof(value));
+}
+
+void DrainageNetwork::saveBinary(const char *filename)
+{
+	vector<char> buffer(NETWORK_BUFFER_SIZE);
+	ofstream ofs;
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	ofs.open(filename, ofstream::binary);
+
+	// Header
+	ofs.write("DNET", 4);
+	writeUInt(ofs, 2);
+	writeUInt(ofs, dimX);
+	writeUInt(ofs, dimY);
+	writeUInt(ofs, cellDimX);
+	writeUInt(ofs, cellDimY);
+	writeUInt64(ofs, nodes.size());
+	writeUInt64(ofs, segments.size());
+
+	// Nodes: x, y, type
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		writeUInt(ofs, nodes[n].x);
+		writeUInt(ofs, nodes[n].y);
+		writeUInt(ofs, nodes[n].type);
+	}
+
+	// Segments: from, to (64 bit), order, maxDA, number of cells (64 bit) and the x, y of each cell
+	for (size_t s = 0; s < segments.size(); ++s) {
+		const NetworkSegment &segment = segments[s];
+		writeUInt64(ofs, segment.from);
+		writeUInt64(ofs, segment.to);
+		writeUInt(ofs, segment.order);
+		ofs.write((const char *)&segment.maxDA, sizeof(segment.maxDA));
+		writeUInt64(ofs, segment.numPoints);
+		for (size_t p = 0; p < segment.numPoints; ++p) {
+			writeUInt(ofs, (unsigned)(points[segment.firstPoint + p] % dimX));
+			writeUInt(ofs, (unsigned)(points[segment.firstPoint + p] / dimX));
+		}
+	}
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,84 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <vector>
+#include "grid.h"
+
+/** Node of the vector drainage network */
+struct NetworkNode {
+	enum Type { SOURCE = 0, JUNCTION = 1, OUTLET = 2 };
+
+	/** Position of the node cell */
+	unsigned x, y;
+	/** Type of the node */
+	unsigned type;
+};
+
+/** Segment of the vector drainage network between two nodes */
+struct NetworkSegment {
+	/** Upstream and downstream nodes */
+	size_t from, to;
+	/** Strahler order */
+	unsigned order;
+	/** Maximum DA value along the segment */
+	HEIGHT maxDA;
+	/** Cells of the segment, stored from upstream to downstream in DrainageNetwork::points */
+	size_t firstPoint, numPoints;
+};
+
+/** This class builds a polyline graph from the cells of the drainage network
+(the result cells of a grid) and their flow directions */
+class DrainageNetwork {
+
+public:
+	/** Extracts the network from the result cells of the grid */
+	void extract(Grid &grid);
+
+	/** Saves the network to a GeoJSON file. Coordinates are meters from the lower-left cell of the grid */
+	void saveGeoJSON(const char *filename);
+
+	/** Saves the network to a binary (little-endian) edge list */
+	void saveBinary(const char *filename);
+
+	/** Gets the number of nodes */
+	inline size_t getNumNodes() { return nodes.size(); }
+
+	/** Gets the number of segments */
+	inline size_t getNumSegments() { return segments.size(); }
+
+private:
+	/** Grid dimentions */
+	unsigned dimX, dimY;
+	/** Cell dimentions */
+	unsigned cellDimX, cellDimY;
+	/** Nodes of the network */
+	std::vector<NetworkNode> nodes;
+	/** Segments of the network, ordered from upstream to downstream */
+	std::vector<NetworkSegment> segments;
+	/** Cells of the segments (indices in the cells buffer of the grid) */
+	std::vector<size_t> points;
+};
+
+#endif
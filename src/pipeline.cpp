@@ -0,0 +1,104 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+
+#include "pipeline.h"
+#include "boundedqueue.h"
+#include "trace.h"
+
+using namespace std;
+
+/** Tile travelling through the pipeline */
+struct TileJob {
+	/** Input file */
+	string input;
+	/** Grid holding the tile */
+	Grid *grid;
+	/** Error message of the stage that failed, if any */
+	string error;
+};
+
+/** Serializes the error messages of the stages */
+static mutex outputMutex;
+
+//-----------------------------------------------------------------
+
+static void runStage(TilePipeline::Stage &stage, TileJob &job, const char *name)
+{
+	if (!job.error.empty())
+		return;
+	try {
+		TraceSpan span(name);
+		stage(*job.grid, job.input);
+	} catch(std::exception &e) {
+		job.error = string("error ") + name + " " + job.input + ": " + e.what();
+	}
+}
+
+//-----------------------------------------------------------------
+
+TilePipeline::TilePipeline(Stage load, Stage compute, Stage save) : load(load), compute(compute), save(save)
+{
+	for (int i = 0; i < PIPELINE_GRIDS; ++i)
+		grids[i] = new Grid(1, 1);
+}
+
+//-----------------------------------------------------------------
+
+TilePipeline::~TilePipeline()
+{
+	for (int i = 0; i < PIPELINE_GRIDS; ++i)
+		delete grids[i];
+}
+
+//-----------------------------------------------------------------
+
+int TilePipeline::run(const vector<string> &inputs)
+{
+	BoundedQueue<Grid *> freeGrids(PIPELINE_GRIDS);
+	BoundedQueue<TileJob> loaded(1), computed(1);
+	int numErrors = 0;
+
+	for (int i = 0; i < PIPELINE_GRIDS; ++i)
+		freeGrids.push(grids[i]);
+
+	thread loader([&]() {
+		Trace::nameThread("pipeline loader");
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			TileJob job;
+			job.input = inputs[i];
+			freeGrids.pop(job.grid);
+			runStage(load, job, "loading");
+			loaded.push(job);
+		}
+		loaded.close();
+	});
+
+	thread writer([&]() {
+		Trace::nameThread("pipeline writer");
+		TileJob job;
+		while (computed.pop(job)) {
+			runStage(save, job, "saving");
+			if (!job.error.empty()) {
+				lock_guard<mutex> lock(outputMutex);
+				cout << "Tile " << job.input << ": " << job.error << endl;
+				++numErrors;
+			}
+			freeGrids.push(job.grid);
+		}
+	});
+
+	// Compute stage runs in the calling thread
+	TileJob job;
+	while (loaded.pop(job)) {
+		runStage(compute, job, "computing");
+		computed.push(job);
+	}
+	computed.close();
+
+	loader.join();
+	writer.join();
+	return numErrors;
+}
+
+//-----------------------------------------------------------------
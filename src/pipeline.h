@@ -0,0 +1,61 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "grid.h"
+
+/** Number of grids shared by the stages: one loading, one computing and one being saved */
+#define PIPELINE_GRIDS 3
+
+/** This class runs a multi-tile job as three concurrent stages (load, compute and save)
+connected by bounded queues. While tile N is computed, tile N+1 is loaded and tile N-1 is
+saved. The stages recycle a fixed set of grids, so the grid storage is only allocated
+for the first tiles (or when the tile size changes) */
+class TilePipeline {
+
+public:
+	/** Stage of the pipeline. Errors are reported by throwing an exception */
+	typedef std::function<void (Grid &grid, const std::string &input)> Stage;
+
+	/** Constructor */
+	TilePipeline(Stage load, Stage compute, Stage save);
+
+	/** Destructor */
+	~TilePipeline();
+
+	/** Processes the tiles. Returns the number of tiles that could not be processed */
+	int run(const std::vector<std::string> &inputs);
+
+private:
+	/** Stages */
+	Stage load, compute, save;
+	/** Grids recycled by the stages */
+	Grid *grids[PIPELINE_GRIDS];
+};
+
+#endif
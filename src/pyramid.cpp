@@ -0,0 +1,240 @@
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+#ifdef _WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+#endif
+
+#include "pyramid.h"
+
+using namespace std;
+
+//-----------------------------------------------------------------
+
+/** Creates a directory if it does not exist */
+static void makeDirectory(const string &path)
+{
+	#ifdef _WIN32
+		int result = _mkdir(path.c_str());
+	#else
+		int result = mkdir(path.c_str(), 0755);
+	#endif
+	if (result != 0 && errno != EEXIST)
+		throw runtime_error("cannot create directory " + path);
+}
+
+//-----------------------------------------------------------------
+
+/** Appends a big-endian 32 bit value */
+static void putUInt(vector<unsigned char> &data, unsigned value)
+{
+	data.push_back((unsigned char)(value >> 24));
+	data.push_back((unsigned char)(value >> 16));
+	data.push_back((unsigned char)(value >> 8));
+	data.push_back((unsigned char)value);
+}
+
+/** Appends a PNG chunk */
+static void putChunk(vector<unsigned char> &data, const char *type, const unsigned char *chunk, size_t size)
+{
+	putUInt(data, (unsigned)size);
+	size_t begin = data.size();
+	data.insert(data.end(), type, type + 4);
+	data.insert(data.end(), chunk, chunk + size);
+	putUInt(data, (unsigned)crc32(0L, &data[begin], (uInt)(data.size() - begin)));
+}
+
+//-----------------------------------------------------------------
+
+void TilePyramid::build(Grid &grid)
+{
+	this->grid = &grid;
+	levels.clear();
+
+	maxDA = 0.0f;
+	unsigned dimX = grid.getDimX(), dimY = grid.getDimY();
+	#pragma omp parallel
+	{
+		HEIGHT threadMaxDA = 0.0f;
+		#pragma omp for schedule(static)
+		for (int r = 0; r < (int)dimY; ++r) {
+			Cell *cell = grid.getCell(0, r);
+			for (unsigned c = 0; c < dimX; ++c, ++cell)
+				if (cell->isInResult() && cell->getDA() > threadMaxDA)
+					threadMaxDA = cell->getDA();
+		}
+		#pragma omp critical
+		maxDA = max(maxDA, threadMaxDA);
+	}
+
+	// Each level halves the previous one until it fits in a tile
+	while (dimX > PYRAMID_TILE_SIZE || dimY > PYRAMID_TILE_SIZE) {
+		unsigned level = (unsigned)levels.size();
+		Level next;
+		next.dimX = (dimX + 1) / 2;
+		next.dimY = (dimY + 1) / 2;
+		next.da.resize((size_t)next.dimX * next.dimY);
+		next.water.resize((size_t)next.dimX * next.dimY);
+
+		#pragma omp parallel for schedule(static)
+		for (int r = 0; r < (int)next.dimY; ++r) {
+			for (unsigned c = 0; c < next.dimX; ++c) {
+				float da = -1.0f, pixelDA;
+				bool water = true, pixelWater;
+				for (unsigned y = 2 * r; y < min(2u * r + 2, dimY); ++y) {
+					for (unsigned x = 2 * c; x < min(2 * c + 2, dimX); ++x) {
+						getPixel(level, x, y, pixelDA, pixelWater);
+						da = max(da, pixelDA);
+						water = water && pixelWater;
+					}
+				}
+				next.da[(size_t)r * next.dimX + c] = da;
+				next.water[(size_t)r * next.dimX + c] = water ? 1 : 0;
+			}
+		}
+
+		levels.push_back(Level());
+		levels.back().dimX = next.dimX;
+		levels.back().dimY = next.dimY;
+		levels.back().da.swap(next.da);
+		levels.back().water.swap(next.water);
+		dimX = next.dimX;
+		dimY = next.dimY;
+	}
+}
+
+//-----------------------------------------------------------------
+
+void TilePyramid::getLevelDim(unsigned level, unsigned &dimX, unsigned &dimY)
+{
+	dimX = level == 0 ? grid->getDimX() : levels[level - 1].dimX;
+	dimY = level == 0 ? grid->getDimY() : levels[level - 1].dimY;
+}
+
+//-----------------------------------------------------------------
+
+void TilePyramid::encodeTile(unsigned level, unsigned tileX, unsigned tileY, int format, ColorTable &colors, vector<unsigned char> &data)
+{
+	unsigned dimX, dimY;
+	getLevelDim(level, dimX, dimY);
+	unsigned x0 = tileX * PYRAMID_TILE_SIZE, y0 = tileY * PYRAMID_TILE_SIZE;
+	unsigned width = min(dimX - x0, (unsigned)PYRAMID_TILE_SIZE), height = min(dimY - y0, (unsigned)PYRAMID_TILE_SIZE);
+	float da;
+	bool water;
+
+	if (format == PYRAMID_RAW) {
+		vector<float> values(PYRAMID_TILE_SIZE * PYRAMID_TILE_SIZE, 0.0f);
+		for (unsigned r = 0; r < height; ++r) {
+			for (unsigned c = 0; c < width; ++c) {
+				getPixel(level, x0 + c, y0 + r, da, water);
+				values[r * PYRAMID_TILE_SIZE + c] = max(da, 0.0f);
+			}
+		}
+		data.assign((const unsigned char *)&values[0], (const unsigned char *)&values[0] + values.size() * sizeof(float));
+		return;
+	}
+
+	// RGBA rows, each one preceded by its filter type (none). Pixels outside the grid are transparent
+	const unsigned waterColor = ColorTable::pack(0, 0, 255), black = ColorTable::pack(0, 0, 0);
+	size_t rowSize = 1 + 4 * PYRAMID_TILE_SIZE;
+	vector<unsigned char> pixels(rowSize * PYRAMID_TILE_SIZE, 0);
+	for (unsigned r = 0; r < height; ++r) {
+		unsigned char *line = &pixels[r * rowSize + 1];
+		for (unsigned c = 0; c < width; ++c) {
+			getPixel(level, x0 + c, y0 + r, da, water);
+			unsigned color = da >= 0.0f ? colors.getRampColor(da) : (water ? waterColor : black);
+			line[4 * c] = (unsigned char)(color >> 16);
+			line[4 * c + 1] = (unsigned char)(color >> 8);
+			line[4 * c + 2] = (unsigned char)color;
+			line[4 * c + 3] = 255;
+		}
+	}
+
+	uLongf size = compressBound((uLong)pixels.size());
+	vector<unsigned char> compressed(size);
+	if (compress2(&compressed[0], &size, &pixels[0], (uLong)pixels.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+		throw runtime_error("error compressing tile");
+
+	// Header: dimentions, 8 bits per channel, RGBA, deflate, no interlace
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	vector<unsigned char> header;
+	putUInt(header, PYRAMID_TILE_SIZE);
+	putUInt(header, PYRAMID_TILE_SIZE);
+	header.push_back(8);
+	header.push_back(6);
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+
+	data.assign(signature, signature + 8);
+	putChunk(data, "IHDR", &header[0], header.size());
+	putChunk(data, "IDAT", &compressed[0], size);
+	putChunk(data, "IEND", 0, 0);
+}
+
+//-----------------------------------------------------------------
+
+void TilePyramid::save(const char *directory, int format)
+{
+	string root = directory, extension = format == PYRAMID_RAW ? ".raw" : ".png";
+	unsigned numLevels = getNumLevels();
+	ColorTable colors;
+	colors.setupRamp(maxDA);
+	numTiles = 0;
+
+	makeDirectory(root);
+	for (unsigned level = 0; level < numLevels; ++level) {
+		unsigned dimX, dimY, zoom = numLevels - 1 - level;
+		getLevelDim(level, dimX, dimY);
+		unsigned tilesX = (dimX + PYRAMID_TILE_SIZE - 1) / PYRAMID_TILE_SIZE, tilesY = (dimY + PYRAMID_TILE_SIZE - 1) / PYRAMID_TILE_SIZE;
+
+		ostringstream levelPath;
+		levelPath << root << "/" << zoom;
+		makeDirectory(levelPath.str());
+		for (unsigned tx = 0; tx < tilesX; ++tx) {
+			ostringstream columnPath;
+			columnPath << levelPath.str() << "/" << tx;
+			makeDirectory(columnPath.str());
+		}
+
+		// Each thread encodes and writes its own tiles
+		string error;
+		#pragma omp parallel
+		{
+			vector<unsigned char> data;
+			#pragma omp for schedule(dynamic)
+			for (ptrdiff_t t = 0; t < (ptrdiff_t)tilesX * tilesY; ++t) {
+				unsigned tx = (unsigned)(t % tilesX), ty = (unsigned)(t / tilesX);
+				ostringstream path;
+				path << levelPath.str() << "/" << tx << "/" << ty << extension;
+				try {
+					encodeTile(level, tx, ty, format, colors, data);
+					ofstream ofs;
+					ofs.exceptions(ofstream::failbit | ofstream::badbit);
+					ofs.open(path.str().c_str(), ofstream::binary);
+					ofs.write((const char *)&data[0], data.size());
+				} catch(std::exception &) {
+					#pragma omp critical
+					error = "error writing tile " + path.str();
+				}
+			}
+		}
+		if (error != "")
+			throw runtime_error(error);
+		numTiles += (size_t)tilesX * tilesY;
+	}
+
+	ofstream ofs;
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.open((root + "/metadata.json").c_str());
+	ofs << "{\"width\": " << grid->getDimX() << ", \"height\": " << grid->getDimY() << ", \"tileSize\": " << PYRAMID_TILE_SIZE
+		<< ", \"minZoom\": 0, \"maxZoom\": " << numLevels - 1 << ", \"format\": \"" << extension.substr(1)
+		<< "\", \"maxDA\": " << maxDA << "}" << endl;
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,99 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <string>
+#include <vector>
+#include "grid.h"
+#include "colortable.h"
+
+/** Size (in pixels) of the square tiles of the pyramid */
+#define PYRAMID_TILE_SIZE 256
+
+/** Formats of the tiles */
+#define PYRAMID_PNG 0
+#define PYRAMID_RAW 1
+
+/** This class saves the drainage network of a grid as a pyramid of tiles that a map viewer
+(Leaflet, OpenLayers) can load from a static web server. The highest zoom level has a pixel per
+cell and each lower level halves the resolution, down to zoom 0, where the grid fits in one tile.
+A pixel of a lower level takes the maximum DA of the network cells it covers, so that thin
+channels remain visible. The tiles are stored as DIRECTORY/z/x/y.png (coloured like
+Grid::saveImageDA, transparent outside the grid) or DIRECTORY/z/x/y.raw (float32 maximum DA
+of the network cells, 0 elsewhere), together with a DIRECTORY/metadata.json description */
+class TilePyramid {
+
+public:
+	/** Computes the downsampled levels of the grid */
+	void build(Grid &grid);
+
+	/** Saves the tiles of all the levels. Tiles are encoded in parallel */
+	void save(const char *directory, int format);
+
+	/** Gets the number of zoom levels */
+	inline unsigned getNumLevels() { return (unsigned)levels.size() + 1; }
+
+	/** Gets the number of tiles written by the last save */
+	inline size_t getNumTiles() { return numTiles; }
+
+private:
+	/** Downsampled level: maximum DA of the network cells covered by each pixel (negative if none)
+	and whether all of them are sea */
+	struct Level {
+		unsigned dimX, dimY;
+		std::vector<float> da;
+		std::vector<unsigned char> water;
+	};
+
+	/** Grid of the highest zoom level */
+	Grid *grid;
+	/** Levels from half the resolution of the grid to zoom 0 */
+	std::vector<Level> levels;
+	/** Maximum DA of the grid */
+	HEIGHT maxDA;
+	size_t numTiles;
+
+	/** Gets a pixel of a level (0 is the grid) */
+	inline void getPixel(unsigned level, unsigned x, unsigned y, float &da, bool &water) {
+		if (level == 0) {
+			Cell *cell = grid->getCell(x, y);
+			da = cell->isInResult() ? cell->getDA() : -1.0f;
+			water = cell->getZW() == 0.0f;
+		}
+		else {
+			size_t i = (size_t)y * levels[level - 1].dimX + x;
+			da = levels[level - 1].da[i];
+			water = levels[level - 1].water[i] != 0;
+		}
+	}
+
+	/** Gets the dimentions of a level */
+	void getLevelDim(unsigned level, unsigned &dimX, unsigned &dimY);
+
+	/** Encodes a tile of a level into data */
+	void encodeTile(unsigned level, unsigned tileX, unsigned tileY, int format, ColorTable &colors, std::vector<unsigned char> &data);
+};
+
+#endif
@@ -0,0 +1,358 @@
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+
+#include "raster.h"
+
+using namespace std;
+
+/** TIFF field types */
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_DOUBLE 12
+#define TIFF_LONG8 16
+
+/** Classic TIFF files can not address more than 4 GB */
+#define TIFF_MAX_CLASSIC_BYTES 0xF0000000ull
+
+//-----------------------------------------------------------------
+
+/** Image file directory of a TIFF file, written after the image data */
+class TIFFDirectory {
+
+public:
+	/** Constructor. big selects the BigTIFF layout */
+	TIFFDirectory(bool big) : big(big) {}
+
+	/** Adds a field of SHORT values */
+	void addShorts(unsigned short tag, const vector<unsigned long long> &values) {
+		add(tag, TIFF_SHORT, values.size(), values, 2);
+	}
+
+	/** Adds a field of LONG values */
+	void addLongs(unsigned short tag, const vector<unsigned long long> &values) {
+		add(tag, TIFF_LONG, values.size(), values, 4);
+	}
+
+	/** Adds a field of offsets or sizes: LONG values, or LONG8 in BigTIFF files */
+	void addOffsets(unsigned short tag, const vector<unsigned long long> &values) {
+		add(tag, big ? TIFF_LONG8 : TIFF_LONG, values.size(), values, big ? 8 : 4);
+	}
+
+	/** Adds a field of DOUBLE values */
+	void addDoubles(unsigned short tag, const vector<double> &values) {
+		vector<unsigned long long> bits(values.size());
+		for (size_t i = 0; i < values.size(); ++i)
+			memcpy(&bits[i], &values[i], sizeof(double));
+		add(tag, TIFF_DOUBLE, values.size(), bits, 8);
+	}
+
+	/** Writes the directory at the current position of the stream, which must be offset */
+	void write(ofstream &ofs, unsigned long long offset) {
+		size_t wordSize = big ? 8 : 4;
+		unsigned long long external = offset + (big ? 8 : 2) + entries.size() * (big ? 20 : 12) + wordSize;
+		vector<unsigned char> directory, data;
+
+		// Entries are sorted by tag; values that do not fit in an entry follow the directory
+		sort(entries.begin(), entries.end());
+		putValue(directory, entries.size(), big ? 8 : 2);
+		for (size_t i = 0; i < entries.size(); ++i) {
+			Entry &entry = entries[i];
+			putValue(directory, entry.tag, 2);
+			putValue(directory, entry.type, 2);
+			putValue(directory, entry.count, wordSize);
+			if (entry.bytes.size() <= wordSize) {
+				directory.insert(directory.end(), entry.bytes.begin(), entry.bytes.end());
+				directory.resize(directory.size() + wordSize - entry.bytes.size(), 0);
+			}
+			else {
+				putValue(directory, external + data.size(), wordSize);
+				data.insert(data.end(), entry.bytes.begin(), entry.bytes.end());
+				if (data.size() % 2)
+					data.push_back(0);
+			}
+		}
+		// No more directories
+		putValue(directory, 0, wordSize);
+
+		ofs.write((const char *)&directory[0], directory.size());
+		if (!data.empty())
+			ofs.write((const char *)&data[0], data.size());
+	}
+
+	/** Appends a little-endian value */
+	static void putValue(vector<unsigned char> &bytes, unsigned long long value, size_t size) {
+		for (size_t i = 0; i < size; ++i)
+			bytes.push_back((unsigned char)(value >> (8 * i)));
+	}
+
+private:
+	struct Entry {
+		unsigned short tag, type;
+		unsigned long long count;
+		vector<unsigned char> bytes;
+
+		bool operator<(const Entry &entry) const { return tag < entry.tag; }
+	};
+
+	bool big;
+	vector<Entry> entries;
+
+	void add(unsigned short tag, unsigned short type, unsigned long long count, const vector<unsigned long long> &values, size_t size) {
+		Entry entry;
+		entry.tag = tag;
+		entry.type = type;
+		entry.count = count;
+		for (size_t i = 0; i < values.size(); ++i)
+			putValue(entry.bytes, values[i], size);
+		entries.push_back(entry);
+	}
+};
+
+//-----------------------------------------------------------------
+
+RasterWriter::RasterWriter(Grid &grid, const string &tileName, unsigned tileDimX, unsigned tileDimY) : grid(grid)
+{
+	geo = getGeoReference(tileName, tileDimX, tileDimY, grid.getOriginX(), grid.getOriginY());
+}
+
+//-----------------------------------------------------------------
+
+GeoReference RasterWriter::getGeoReference(const string &tileName, unsigned tileDimX, unsigned tileDimY,
+	unsigned originX, unsigned originY)
+{
+	GeoReference geo;
+	geo.valid = false;
+	geo.originX = geo.originY = 0.0;
+	geo.cellSizeX = geo.cellSizeY = 0.0;
+
+	// Tiles are named after the latitude and longitude of their lower left corner: N37W004
+	string name = tileName.substr(tileName.find_last_of("/\\") + 1);
+	if (name.size() < 7 || tileDimX < 2 || tileDimY < 2)
+		return geo;
+	char ns = (char)toupper(name[0]), ew = (char)toupper(name[3]);
+	if ((ns != 'N' && ns != 'S') || (ew != 'E' && ew != 'W'))
+		return geo;
+	for (int i = 1; i < 7; ++i)
+		if (i != 3 && !isdigit((unsigned char)name[i]))
+			return geo;
+	int latitude = atoi(name.substr(1, 2).c_str()) * (ns == 'N' ? 1 : -1);
+	int longitude = atoi(name.substr(4, 3).c_str()) * (ew == 'E' ? 1 : -1);
+
+	// The samples of the border rows and columns lie on the edges of the tile
+	geo.valid = true;
+	geo.cellSizeX = 1.0 / (tileDimX - 1);
+	geo.cellSizeY = 1.0 / (tileDimY - 1);
+	geo.originX = longitude + originX * geo.cellSizeX;
+	geo.originY = latitude + 1 - originY * geo.cellSizeY;
+	return geo;
+}
+
+//-----------------------------------------------------------------
+
+void RasterWriter::open(ofstream &ofs, const char *filename, vector<char> &buffer)
+{
+	buffer.resize(RASTER_BUFFER_SIZE);
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	ofs.open(filename, ofstream::binary);
+}
+
+//-----------------------------------------------------------------
+
+void RasterWriter::saveRaw(const char *filename, int plane)
+{
+	unsigned dimX = grid.getDimX(), dimY = grid.getDimY();
+	vector<char> buffer;
+	ofstream ofs;
+	open(ofs, filename, buffer);
+
+	vector<unsigned char> header;
+	header.push_back('D');
+	header.push_back('R');
+	header.push_back('S');
+	header.push_back('T');
+	TIFFDirectory::putValue(header, 1, 4);
+	TIFFDirectory::putValue(header, dimX, 4);
+	TIFFDirectory::putValue(header, dimY, 4);
+	TIFFDirectory::putValue(header, plane, 4);
+	TIFFDirectory::putValue(header, grid.getCellDimX(), 4);
+	TIFFDirectory::putValue(header, grid.getCellDimY(), 4);
+	TIFFDirectory::putValue(header, geo.valid ? 1 : 0, 4);
+	double position[4] = { geo.originX, geo.originY, geo.cellSizeX, geo.cellSizeY };
+	for (int i = 0; i < 4; ++i) {
+		unsigned long long bits;
+		memcpy(&bits, &position[i], sizeof(bits));
+		TIFFDirectory::putValue(header, bits, 8);
+	}
+	TIFFDirectory::putValue(header, RASTER_RAW_OFFSET, 8);
+	header.resize(RASTER_RAW_OFFSET, 0);
+	ofs.write((const char *)&header[0], header.size());
+
+	// Blocks of rows are converted in parallel and written sequentially
+	unsigned blockRows = max(1u, (unsigned)(RASTER_BUFFER_SIZE / sizeof(float) / dimX));
+	vector<float> values((size_t)blockRows * dimX);
+	for (unsigned r0 = 0; r0 < dimY; r0 += blockRows) {
+		unsigned r1 = min(r0 + blockRows, dimY);
+
+		#pragma omp parallel for schedule(static)
+		for (int r = (int)r0; r < (int)r1; ++r) {
+			Cell *cell = grid.getCell(0, r);
+			float *line = &values[(size_t)(r - r0) * dimX];
+			for (unsigned c = 0; c < dimX; ++c, ++cell)
+				line[c] = getValue(cell, plane);
+		}
+		ofs.write((const char *)&values[0], (size_t)(r1 - r0) * dimX * sizeof(float));
+	}
+}
+
+//-----------------------------------------------------------------
+
+void RasterWriter::encodeTile(unsigned tileX, unsigned tileY, int plane, bool compress, vector<unsigned char> &data)
+{
+	unsigned dimX = grid.getDimX(), dimY = grid.getDimY();
+	size_t sampleSize = plane == RASTER_MASK ? 1 : sizeof(float), rowSize = RASTER_TILE_SIZE * sampleSize;
+	vector<unsigned char> tile(RASTER_TILE_SIZE * rowSize, 0), row(rowSize);
+
+	// The tiles of the last row and column are padded with zeros
+	unsigned x0 = tileX * RASTER_TILE_SIZE, y0 = tileY * RASTER_TILE_SIZE;
+	unsigned width = min(dimX - x0, (unsigned)RASTER_TILE_SIZE), height = min(dimY - y0, (unsigned)RASTER_TILE_SIZE);
+	for (unsigned r = 0; r < height; ++r) {
+		Cell *cell = grid.getCell(x0, y0 + r);
+		unsigned char *line = &tile[r * rowSize];
+		if (plane == RASTER_MASK)
+			for (unsigned c = 0; c < width; ++c)
+				line[c] = cell[c].isInResult() ? 1 : 0;
+		else
+			for (unsigned c = 0; c < width; ++c) {
+				float value = getValue(cell + c, plane);
+				memcpy(line + c * sizeof(float), &value, sizeof(float));
+			}
+	}
+
+	if (!compress) {
+		data.swap(tile);
+		return;
+	}
+
+	// Predictors: the bytes of the floats are grouped by significance, most significant first
+	// (floating point predictor), and each byte is replaced by its difference with the previous one
+	for (unsigned r = 0; r < RASTER_TILE_SIZE; ++r) {
+		unsigned char *line = &tile[r * rowSize];
+		if (sampleSize > 1) {
+			for (unsigned c = 0; c < RASTER_TILE_SIZE; ++c)
+				for (size_t b = 0; b < sampleSize; ++b)
+					row[(sampleSize - 1 - b) * RASTER_TILE_SIZE + c] = line[c * sampleSize + b];
+			memcpy(line, &row[0], rowSize);
+		}
+		for (size_t i = rowSize - 1; i > 0; --i)
+			line[i] -= line[i - 1];
+	}
+
+	uLongf size = compressBound((uLong)tile.size());
+	data.resize(size);
+	if (compress2(&data[0], &size, &tile[0], (uLong)tile.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+		throw runtime_error("error compressing GeoTIFF tile");
+	data.resize(size);
+}
+
+//-----------------------------------------------------------------
+
+void RasterWriter::saveGeoTIFF(const char *filename, int plane, bool compress)
+{
+	unsigned dimX = grid.getDimX(), dimY = grid.getDimY();
+	unsigned tilesX = (dimX + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE, tilesY = (dimY + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+	size_t sampleSize = plane == RASTER_MASK ? 1 : sizeof(float);
+	size_t tileBound = compressBound((uLong)(RASTER_TILE_SIZE * RASTER_TILE_SIZE * sampleSize));
+	bool big = (unsigned long long)tilesX * tilesY * tileBound > TIFF_MAX_CLASSIC_BYTES;
+
+	vector<char> buffer;
+	ofstream ofs;
+	open(ofs, filename, buffer);
+
+	// Header. The offset of the directory is written at the end
+	vector<unsigned char> header;
+	header.push_back('I');
+	header.push_back('I');
+	if (big) {
+		TIFFDirectory::putValue(header, 43, 2);
+		TIFFDirectory::putValue(header, 8, 2);
+		TIFFDirectory::putValue(header, 0, 2);
+		TIFFDirectory::putValue(header, 0, 8);
+	}
+	else {
+		TIFFDirectory::putValue(header, 42, 2);
+		TIFFDirectory::putValue(header, 0, 4);
+	}
+	ofs.write((const char *)&header[0], header.size());
+	unsigned long long offset = header.size();
+
+	// Rows of tiles are encoded in parallel and written sequentially
+	vector<unsigned long long> tileOffsets, tileSizes;
+	vector< vector<unsigned char> > tiles(tilesX);
+	for (unsigned ty = 0; ty < tilesY; ++ty) {
+		bool failed = false;
+		#pragma omp parallel for schedule(dynamic)
+		for (int tx = 0; tx < (int)tilesX; ++tx) {
+			try {
+				encodeTile(tx, ty, plane, compress, tiles[tx]);
+			} catch(std::exception &) {
+				failed = true;
+			}
+		}
+		if (failed)
+			throw runtime_error("error compressing GeoTIFF tile");
+
+		for (unsigned tx = 0; tx < tilesX; ++tx) {
+			ofs.write((const char *)&tiles[tx][0], tiles[tx].size());
+			tileOffsets.push_back(offset);
+			tileSizes.push_back(tiles[tx].size());
+			offset += tiles[tx].size();
+		}
+	}
+	if (offset % 2) {
+		ofs.put(0);
+		++offset;
+	}
+
+	TIFFDirectory directory(big);
+	directory.addLongs(256, vector<unsigned long long>(1, dimX));
+	directory.addLongs(257, vector<unsigned long long>(1, dimY));
+	directory.addShorts(258, vector<unsigned long long>(1, sampleSize * 8));
+	// Compression: none or deflate
+	directory.addShorts(259, vector<unsigned long long>(1, compress ? 8 : 1));
+	// Photometric interpretation: black is zero
+	directory.addShorts(262, vector<unsigned long long>(1, 1));
+	directory.addShorts(277, vector<unsigned long long>(1, 1));
+	directory.addShorts(284, vector<unsigned long long>(1, 1));
+	// Predictor: floating point for the floats, horizontal differencing for the mask
+	if (compress)
+		directory.addShorts(317, vector<unsigned long long>(1, sampleSize > 1 ? 3 : 2));
+	directory.addShorts(322, vector<unsigned long long>(1, RASTER_TILE_SIZE));
+	directory.addShorts(323, vector<unsigned long long>(1, RASTER_TILE_SIZE));
+	directory.addOffsets(324, tileOffsets);
+	directory.addOffsets(325, tileSizes);
+	// Sample format: float or unsigned integer
+	directory.addShorts(339, vector<unsigned long long>(1, sampleSize > 1 ? 3 : 1));
+
+	if (geo.valid) {
+		double scale[3] = { geo.cellSizeX, geo.cellSizeY, 0.0 };
+		double tiePoint[6] = { 0.0, 0.0, 0.0, geo.originX, geo.originY, 0.0 };
+		// Geographic WGS84 model, samples at the center of the cells (pixel is point)
+		unsigned long long keys[16] = { 1, 1, 0, 3, 1024, 0, 1, 2, 1025, 0, 1, 2, 2048, 0, 1, 4326 };
+		directory.addDoubles(33550, vector<double>(scale, scale + 3));
+		directory.addDoubles(33922, vector<double>(tiePoint, tiePoint + 6));
+		directory.addShorts(34735, vector<unsigned long long>(keys, keys + 16));
+	}
+	directory.write(ofs, offset);
+
+	ofs.seekp(big ? 8 : 4);
+	vector<unsigned char> directoryOffset;
+	TIFFDirectory::putValue(directoryOffset, offset, big ? 8 : 4);
+	ofs.write((const char *)&directoryOffset[0], directoryOffset.size());
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,107 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include "grid.h"
+
+/** Planes saved by RasterWriter */
+#define RASTER_DA 1
+#define RASTER_W 2
+#define RASTER_ZW 4
+#define RASTER_MASK 8
+
+/** Offset of the values in the raw rasters, so that they can be mapped as a page aligned array */
+#define RASTER_RAW_OFFSET 4096
+/** Size (in cells) of the square tiles of the GeoTIFF rasters */
+#define RASTER_TILE_SIZE 256
+/** Size of the buffer of the output streams */
+#define RASTER_BUFFER_SIZE (4 << 20)
+
+/** Position of a raster in geographic coordinates (WGS84 degrees) */
+struct GeoReference {
+	/** Whether the position is known */
+	bool valid;
+	/** Longitude and latitude of the first (upper left) cell */
+	double originX, originY;
+	/** Size of the cells */
+	double cellSizeX, cellSizeY;
+};
+
+/** This class saves the values of the planes of a grid (DA, W, Z + W and the result mask) without
+loss, as raw float32 rasters or as tiled GeoTIFF files.
+
+Raw layout (little endian): "DRST", version, dimX, dimY, plane, cellDimX, cellDimY (uint32), a
+georeferenced flag (uint32), originX, originY, cellSizeX, cellSizeY (double) and the offset of the
+values (uint64, RASTER_RAW_OFFSET), followed by dimX x dimY float32 values in raster order at that offset.
+
+GeoTIFF files have tiles of RASTER_TILE_SIZE x RASTER_TILE_SIZE cells, float32 values (8 bit for the
+mask) and, if the grid was loaded from a tile named after its corner (N37W004.hgt), a WGS84 position.
+BigTIFF is used when the file may exceed 4 GB */
+class RasterWriter {
+
+public:
+	/** Constructor.
+	\param tileName Name of the HGT file the grid was loaded from
+	\param tileDimX, tileDimY Dimentions of the HGT tile, which spans one degree */
+	RasterWriter(Grid &grid, const std::string &tileName, unsigned tileDimX, unsigned tileDimY);
+
+	/** Saves a plane (RASTER_DA, RASTER_W, RASTER_ZW or RASTER_MASK) as a raw float32 raster */
+	void saveRaw(const char *filename, int plane);
+
+	/** Saves a plane as a tiled GeoTIFF, deflate compressed if compress is true */
+	void saveGeoTIFF(const char *filename, int plane, bool compress);
+
+	/** Gets the position of the grid */
+	inline const GeoReference &getGeoReference() { return geo; }
+
+	/** Gets the position of a grid cropped from a HGT tile named after its corner (N37W004) */
+	static GeoReference getGeoReference(const std::string &tileName, unsigned tileDimX, unsigned tileDimY,
+		unsigned originX, unsigned originY);
+
+private:
+	Grid &grid;
+	GeoReference geo;
+
+	/** Gets the value of a plane of a cell */
+	static inline float getValue(Cell *cell, int plane) {
+		switch (plane) {
+			case RASTER_DA: return cell->getDA();
+			case RASTER_W: return cell->getW();
+			case RASTER_ZW: return cell->getZW();
+			default: return cell->isInResult() ? 1.0f : 0.0f;
+		}
+	}
+
+	/** Encodes a tile of a GeoTIFF into data */
+	void encodeTile(unsigned tileX, unsigned tileY, int plane, bool compress, std::vector<unsigned char> &data);
+
+	/** Opens a buffered output stream */
+	static void open(std::ofstream &ofs, const char *filename, std::vector<char> &buffer);
+};
+
+#endif
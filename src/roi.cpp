@@ -0,0 +1,138 @@
+#include <queue>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "roi.h"
+
+using namespace std;
+
+/** States of the cells during the priority flood */
+#define UNVISITED 0
+#define VISITED 1
+#define CATCHMENT 2
+
+//-----------------------------------------------------------------
+
+/** Marks the cells within margin cells of a marked cell along a line of n values (stride apart) */
+static void growLine(unsigned char *values, size_t n, ptrdiff_t stride, unsigned margin)
+{
+	// Distance to the last marked value, from the beginning and then from the end
+	vector<unsigned> distance(n);
+	unsigned last = margin + 1;
+	for (size_t k = 0; k < n; ++k) {
+		last = values[k * stride] ? 0 : min(last + 1, margin + 1);
+		distance[k] = last;
+	}
+	last = margin + 1;
+	for (size_t k = n; k-- > 0; ) {
+		last = values[k * stride] ? 0 : min(last + 1, margin + 1);
+		values[k * stride] = min(distance[k], last) <= margin;
+	}
+}
+
+//-----------------------------------------------------------------
+
+void RegionOfInterest::find(Grid &grid, unsigned firstX, unsigned firstY, unsigned lastX, unsigned lastY, unsigned margin)
+{
+	unsigned gridDimX = grid.getDimX(), gridDimY = grid.getDimY();
+	if (firstX > lastX || firstY > lastY || lastX >= gridDimX || lastY >= gridDimY)
+		throw runtime_error("the region of interest is outside the grid");
+
+	size_t numCells = (size_t)gridDimX * gridDimY;
+	vector<unsigned char> state(numCells, UNVISITED);
+	vector<HEIGHT> filled(numCells);
+	typedef pair<HEIGHT, size_t> Entry;
+	priority_queue<Entry, vector<Entry>, greater<Entry> > open;
+	queue<size_t> pit;
+
+	// The water leaves the grid through the border and sea cells
+	for (unsigned r = 0; r < gridDimY; ++r) {
+		for (unsigned c = 0; c < gridDimX; ++c) {
+			Cell *cell = grid.getCell(c, r);
+			if (r == 0 || c == 0 || r == gridDimY - 1 || c == gridDimX - 1 || cell->getZ() <= 0.0f) {
+				size_t i = (size_t)r * gridDimX + c;
+				bool inRegion = c >= firstX && c <= lastX && r >= firstY && r <= lastY;
+				state[i] = inRegion ? CATCHMENT : VISITED;
+				filled[i] = cell->getZ();
+				open.push(Entry(filled[i], i));
+			}
+		}
+	}
+
+	// Each cell drains to the cell that reaches it first, so it belongs to the catchment if that cell
+	// does or if it is in the region. Cells lower than the spill level fill up to it
+	numCatchmentCells = 0;
+	while (!open.empty() || !pit.empty()) {
+		size_t i;
+		if (!pit.empty()) {
+			i = pit.front();
+			pit.pop();
+		}
+		else {
+			i = open.top().second;
+			open.pop();
+		}
+		if (state[i] == CATCHMENT)
+			++numCatchmentCells;
+
+		unsigned x = (unsigned)(i % gridDimX), y = (unsigned)(i / gridDimX);
+		for (unsigned ny = (y > 0 ? y - 1 : y); ny <= y + 1 && ny < gridDimY; ++ny) {
+			for (unsigned nx = (x > 0 ? x - 1 : x); nx <= x + 1 && nx < gridDimX; ++nx) {
+				size_t n = (size_t)ny * gridDimX + nx;
+				if (state[n] != UNVISITED)
+					continue;
+				bool inRegion = nx >= firstX && nx <= lastX && ny >= firstY && ny <= lastY;
+				state[n] = (inRegion || state[i] == CATCHMENT) ? CATCHMENT : VISITED;
+				HEIGHT z = grid.getCell(nx, ny)->getZ();
+				if (z <= filled[i]) {
+					filled[n] = filled[i];
+					pit.push(n);
+				}
+				else {
+					filled[n] = z;
+					open.push(Entry(z, n));
+				}
+			}
+		}
+	}
+	filled.clear();
+	filled.shrink_to_fit();
+
+	// Bounding box of the catchment grown by the margin
+	unsigned minX = gridDimX, minY = gridDimY, maxX = 0, maxY = 0;
+	for (unsigned r = 0; r < gridDimY; ++r) {
+		for (unsigned c = 0; c < gridDimX; ++c) {
+			if (state[(size_t)r * gridDimX + c] == CATCHMENT) {
+				minX = min(minX, c);
+				maxX = max(maxX, c);
+				minY = min(minY, r);
+				maxY = max(maxY, r);
+			}
+		}
+	}
+	this->firstX = minX > margin ? minX - margin : 0;
+	this->firstY = minY > margin ? minY - margin : 0;
+	dimX = min(maxX + margin, gridDimX - 1) - this->firstX + 1;
+	dimY = min(maxY + margin, gridDimY - 1) - this->firstY + 1;
+
+	// Kept cells: the catchment grown by the margin along the rows and then along the columns
+	keep.resize((size_t)dimX * dimY);
+	for (unsigned r = 0; r < dimY; ++r)
+		for (unsigned c = 0; c < dimX; ++c)
+			keep[(size_t)r * dimX + c] = state[(size_t)(this->firstY + r) * gridDimX + this->firstX + c] == CATCHMENT;
+	for (unsigned r = 0; r < dimY; ++r)
+		growLine(&keep[(size_t)r * dimX], dimX, 1, margin);
+	for (unsigned c = 0; c < dimX; ++c)
+		growLine(&keep[c], dimY, dimX, margin);
+	numKeptCells = count(keep.begin(), keep.end(), 1);
+}
+
+//-----------------------------------------------------------------
+
+void RegionOfInterest::apply(Grid &grid)
+{
+	grid.crop(firstX, firstY, dimX, dimY, &keep[0]);
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,76 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+#ifndef ROI_H
+#define ROI_H
+
+#include <vector>
+#include "grid.h"
+
+/** Number of cells kept around the catchment of a region of interest by default */
+#define ROI_MARGIN 16
+
+/** This class reduces a grid to the catchment of a region of interest: the cells whose water reaches
+a rectangle of cells (a single cell for an outlet) on the filled DEM, plus a margin. The filled DEM and
+its flow directions are computed with a priority flood from the border and sea cells, so the flats
+and pits of the DEM are drained towards their spill points */
+class RegionOfInterest {
+
+public:
+	/** Finds the catchment of the cells firstX to lastX, firstY to lastY of the grid and the cells
+	kept for the simulation: the catchment grown by margin cells in each direction */
+	void find(Grid &grid, unsigned firstX, unsigned firstY, unsigned lastX, unsigned lastY, unsigned margin = ROI_MARGIN);
+
+	/** Crops the grid to the bounding box of the kept cells and turns the other cells of the box into sea */
+	void apply(Grid &grid);
+
+	/** Gets the X position of the first cell of the region in the original grid */
+	inline unsigned getFirstX() { return firstX; }
+
+	/** Gets the Y position of the first cell of the region in the original grid */
+	inline unsigned getFirstY() { return firstY; }
+
+	/** Gets X dimention of the region */
+	inline unsigned getDimX() { return dimX; }
+
+	/** Gets Y dimention of the region */
+	inline unsigned getDimY() { return dimY; }
+
+	/** Gets the number of cells of the catchment */
+	inline size_t getNumCatchmentCells() { return numCatchmentCells; }
+
+	/** Gets the number of cells kept for the simulation */
+	inline size_t getNumKeptCells() { return numKeptCells; }
+
+private:
+	/** Bounding box of the kept cells in the original grid */
+	unsigned firstX, firstY, dimX, dimY;
+	/** Whether each cell of the bounding box is kept */
+	std::vector<unsigned char> keep;
+	/** Number of cells of the catchment */
+	size_t numCatchmentCells;
+	/** Number of cells kept */
+	size_t numKeptCells;
+};
+
+#endif
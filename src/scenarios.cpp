@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "scenarios.h"
+
+using namespace std;
+
+#define INVSQRT2 0.70710678122310f
+#define EPSILON 0.00001f
+
+#define END_TOKEN ((size_t)-1)
+
+/** Values of the neighbour receiving the water of a cell when it is not the same for all the lanes */
+#define NO_TARGET -2
+#define MIXED_TARGETS -3
+
+/** FIFO entries keep the mask of the queued lanes in their lowest bits */
+#define LANE_BITS 8
+#define ENTRY_CELL(entry) ((entry) >> LANE_BITS)
+#define ENTRY_LANES(entry) ((unsigned)(entry) & ((1u << LANE_BITS) - 1))
+
+//-----------------------------------------------------------------
+
+/** Adds water to a lane of a cell, as Cell::addW does */
+static inline void addLaneW(HEIGHT &W, HEIGHT &DA, HEIGHT dW)
+{
+	W += dW;
+	if (W < MIN_WATER_LEVEL)
+		W = 0.0f;
+	if (dW > 0.0f)
+		DA += dW;
+}
+
+//-----------------------------------------------------------------
+
+ScenarioGrid::ScenarioGrid() : dimX(0), dimY(0), numScenarios(0), numLanes(0), Z(0), W(0), DA(0)
+{
+}
+
+//-----------------------------------------------------------------
+
+ScenarioGrid::~ScenarioGrid()
+{
+	release();
+}
+
+//-----------------------------------------------------------------
+
+void ScenarioGrid::release()
+{
+	size_t numCells = (size_t)dimX * dimY;
+	freeLarge(Z, numCells * sizeof(HEIGHT));
+	freeLarge(W, numCells * numLanes * sizeof(HEIGHT));
+	freeLarge(DA, numCells * numLanes * sizeof(HEIGHT));
+	Z = W = DA = 0;
+}
+
+//-----------------------------------------------------------------
+
+void ScenarioGrid::setup(Grid &grid, const vector<HEIGHT> &initW)
+{
+	release();
+	dimX = grid.getDimX();
+	dimY = grid.getDimY();
+	numScenarios = min((int)initW.size(), MAX_SCENARIOS);
+	numLanes = numScenarios <= 4 ? 4 : 8;
+
+	size_t numCells = (size_t)dimX * dimY;
+	if (numCells > (END_TOKEN >> LANE_BITS))
+		throw runtime_error("grid too large for the scenarios");
+	Z = (HEIGHT *)allocLarge(numCells * sizeof(HEIGHT));
+	W = (HEIGHT *)allocLarge(numCells * numLanes * sizeof(HEIGHT));
+	DA = (HEIGHT *)allocLarge(numCells * numLanes * sizeof(HEIGHT));
+
+	HEIGHT laneW[MAX_SCENARIOS];
+	for (int k = 0; k < MAX_SCENARIOS; ++k) {
+		laneW[k] = k < numScenarios ? initW[k] : 0.0f;
+		running[k] = k < numScenarios;
+	}
+
+	// Cells are only written by setW for land cells, as Grid::addW does
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t r = 0; r < (ptrdiff_t)dimY; ++r) {
+		for (unsigned int c = 0; c < dimX; ++c) {
+			Cell *cell = grid.getCell(c, (unsigned)r);
+			size_t i = (size_t)r * dimX + c;
+			Z[i] = cell->getZ();
+			for (int k = 0; k < numLanes; ++k) {
+				W[i * numLanes + k] = Z[i] > 0.0f && k < numScenarios ? cell->getW() + laneW[k] : 0.0f;
+				DA[i * numLanes + k] = 0.0f;
+			}
+		}
+	}
+
+	int n = 0;
+	for (int r = -1; r <= 1; ++r) {
+		for (int c = -1; c <= 1; ++c) {
+			if (c != 0 || r != 0) {
+				neighbourOffsets[n] = (ptrdiff_t)r * dimX + c;
+				neighbourWeights[n] = (c != 0 && r != 0) ? INVSQRT2 : 1.0f;
+				++n;
+			}
+		}
+	}
+
+	// Sea cells never hold water. Each lane may queue every land cell, as Grid::setupFastWaterTransfer allows
+	unsigned allLanes = (1u << numScenarios) - 1;
+	size_t numLandCells = 0;
+	borderCells.assign(numCells, 0);
+	for (size_t i = 0; i < numCells; ++i) {
+		size_t x = i % dimX, y = i / dimX;
+		borderCells[i] = x == 0 || y == 0 || x == dimX - 1 || y == dimY - 1;
+		numLandCells += Z[i] > 0.0f ? 1 : 0;
+	}
+	processingCells.clear();
+	processingCells.resize(numLandCells * numScenarios + 2);
+	for (int k = 0; k < MAX_SCENARIOS; ++k)
+		numQueuedCells[k] = 0;
+	// A first token keeps the cells from joining an empty entry, and is moved after them
+	processingCells.push(END_TOKEN);
+	for (size_t i = 0; i < numCells; ++i)
+		if (Z[i] > 0.0f)
+			queueLanes(i, allLanes);
+	processingCells.pop();
+	processingCells.push(END_TOKEN);
+}
+
+//-----------------------------------------------------------------
+
+template<int LANES>
+void ScenarioGrid::findLowerNeighbours(size_t i, int *lowerNeighbour, HEIGHT *lowerZW)
+{
+	const HEIGHT *cellW = W + i * LANES;
+	HEIGHT cellZ = Z[i];
+	// Local lanes, so that they cannot alias the planes
+	HEIGHT higherSlope[LANES], neighbourZW[LANES];
+	int neighbour[LANES];
+	for (int k = 0; k < LANES; ++k) {
+		higherSlope[k] = -INFINITY;
+		neighbourZW[k] = 0.0f;
+		neighbour[k] = 0;
+	}
+
+	// Each Z is read once for all the lanes
+	for (int n = 0; n < 8; ++n) {
+		size_t j = i + neighbourOffsets[n];
+		HEIGHT neighbourZ = Z[j], weight = neighbourWeights[n];
+		const HEIGHT *neighbourW = W + j * LANES;
+
+		#pragma omp simd
+		for (int k = 0; k < LANES; ++k) {
+			// Loads and stores are unconditional so that the selects are vectorized
+			HEIGHT ZW = neighbourZ + neighbourW[k];
+			HEIGHT slope = ((cellZ + cellW[k]) - ZW) * weight;
+			HEIGHT laneSlope = higherSlope[k], laneZW = neighbourZW[k];
+			int laneNeighbour = neighbour[k];
+			bool steeper = slope > laneSlope;
+			laneSlope = steeper ? slope : laneSlope;
+			laneZW = steeper ? ZW : laneZW;
+			laneNeighbour = steeper ? n : laneNeighbour;
+			higherSlope[k] = laneSlope;
+			neighbourZW[k] = laneZW;
+			neighbour[k] = laneNeighbour;
+		}
+	}
+
+	for (int k = 0; k < LANES; ++k) {
+		lowerNeighbour[k] = neighbour[k];
+		lowerZW[k] = neighbourZW[k];
+	}
+}
+
+//-----------------------------------------------------------------
+
+void ScenarioGrid::queueLanes(size_t i, unsigned lanes)
+{
+	// A lane only joins the last entry, so that its cells keep the order of a separate run
+	size_t &last = processingCells.back();
+	if (last != END_TOKEN && ENTRY_CELL(last) == i && !(ENTRY_LANES(last) & lanes))
+		last |= lanes;
+	else
+		processingCells.push((i << LANE_BITS) | lanes);
+	for (int k = 0; k < numScenarios; ++k)
+		numQueuedCells[k] += (lanes >> k) & 1;
+}
+
+//-----------------------------------------------------------------
+
+template<int LANES>
+void ScenarioGrid::transferLanes(HEIGHT *accum)
+{
+	HEIGHT laneAccum[LANES];
+	for (int k = 0; k < LANES; ++k)
+		laneAccum[k] = 0.0f;
+
+	size_t entry;
+	while ((entry = processingCells.top()) != END_TOKEN) {
+		processingCells.pop();
+		size_t i = ENTRY_CELL(entry);
+		unsigned lanes = ENTRY_LANES(entry);
+
+		// Only the lanes the cell is queued for are processed
+		HEIGHT active[LANES];
+		for (int k = 0; k < LANES; ++k)
+			active[k] = k < numScenarios && running[k] && ((lanes >> k) & 1) ? 1.0f : 0.0f;
+		for (int k = 0; k < numScenarios; ++k)
+			numQueuedCells[k] -= (lanes >> k) & 1;
+
+		bool borderCell = borderCells[i] != 0;
+		HEIGHT *cellW = W + i * LANES;
+		HEIGHT cellZ = Z[i];
+		HEIGHT movingWater[LANES];
+		int lowerNeighbour[LANES];
+
+		if (borderCell) {
+			for (int k = 0; k < LANES; ++k) {
+				movingWater[k] = cellW[k] * active[k];
+				lowerNeighbour[k] = -1;
+			}
+		}
+		else {
+			HEIGHT lowerZW[LANES];
+			findLowerNeighbours<LANES>(i, lowerNeighbour, lowerZW);
+
+			#pragma omp simd
+			for (int k = 0; k < LANES; ++k) {
+				HEIGHT laneW = cellW[k], halfDiff = 0.5f * ((cellZ + laneW) - lowerZW[k]);
+				movingWater[k] = (laneW < halfDiff ? laneW : halfDiff) * active[k];
+			}
+		}
+
+		// Water leaving the cell in every lane
+		HEIGHT sentWater[LANES];
+		#pragma omp simd
+		for (int k = 0; k < LANES; ++k) {
+			//condition to avoid very small water transfers
+			HEIGHT laneSent = movingWater[k] > EPSILON ? movingWater[k] : 0.0f;
+			HEIGHT laneW = cellW[k], remainingW = laneW - laneSent;
+			remainingW = remainingW < MIN_WATER_LEVEL ? 0.0f : remainingW;
+			laneW = laneSent > 0.0f ? remainingW : laneW;
+			cellW[k] = laneW;
+			sentWater[k] = laneSent;
+			laneAccum[k] += laneSent;
+		}
+
+		// The lanes usually send their water to the same neighbour
+		int target = NO_TARGET;
+		for (int k = 0; k < numScenarios; ++k) {
+			if (sentWater[k] > 0.0f)
+				target = (target == NO_TARGET || target == lowerNeighbour[k]) ? lowerNeighbour[k] : MIXED_TARGETS;
+		}
+
+		if (target >= 0) {
+			size_t j = i + neighbourOffsets[target];
+			if (Z[j] > 0.0f) {
+				HEIGHT *neighbourW = W + j * LANES, *neighbourDA = DA + j * LANES;
+				//if the neighbour cell did not have water in a lane, we pushed it into the FIFO because it is going to recieve water
+				unsigned receivers = 0;
+				for (int k = 0; k < numScenarios; ++k)
+					receivers |= (sentWater[k] > 0.0f && neighbourW[k] < EPSILON ? 1u : 0u) << k;
+				if (receivers)
+					queueLanes(j, receivers);
+				#pragma omp simd
+				for (int k = 0; k < LANES; ++k) {
+					HEIGHT laneSent = sentWater[k], laneW = neighbourW[k], receivedW = laneW + laneSent;
+					receivedW = receivedW < MIN_WATER_LEVEL ? 0.0f : receivedW;
+					laneW = laneSent > 0.0f ? receivedW : laneW;
+					neighbourW[k] = laneW;
+					neighbourDA[k] += laneSent;
+				}
+			}
+		}
+		else if (target == MIXED_TARGETS) {
+			for (int k = 0; k < numScenarios; ++k) {
+				if (sentWater[k] == 0.0f)
+					continue;
+				size_t j = i + neighbourOffsets[lowerNeighbour[k]];
+				if (Z[j] > 0.0f) {
+					if (W[j * LANES + k] < EPSILON)
+						queueLanes(j, 1u << k);
+					addLaneW(W[j * LANES + k], DA[j * LANES + k], +sentWater[k]);
+				}
+			}
+		}
+
+		//if the current cell still has water in a processed lane, we pushed it into the FIFO
+		unsigned remaining = 0;
+		for (int k = 0; k < numScenarios; ++k)
+			remaining |= (active[k] > 0.0f && cellW[k] > EPSILON ? 1u : 0u) << k;
+		if (remaining)
+			queueLanes(i, remaining);
+	}
+
+	//remove ending token and add it again after the new list of cells to process
+	processingCells.pop();
+	processingCells.push(END_TOKEN);
+
+	for (int k = 0; k < numScenarios; ++k)
+		accum[k] = laneAccum[k];
+}
+
+//-----------------------------------------------------------------
+
+void ScenarioGrid::waterTransfer(HEIGHT *transfer)
+{
+	if (numLanes == 4)
+		transferLanes<4>(transfer);
+	else
+		transferLanes<8>(transfer);
+}
+
+//-----------------------------------------------------------------
+
+void ScenarioGrid::exportScenario(int k, Grid &grid)
+{
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t r = 0; r < (ptrdiff_t)dimY; ++r) {
+		for (unsigned int c = 0; c < dimX; ++c) {
+			Cell *cell = grid.getCell(c, (unsigned)r);
+			size_t i = (size_t)r * dimX + c;
+			cell->setW(W[i * numLanes + k]);
+			cell->setDA(DA[i * numLanes + k]);
+			cell->unMarkAsResult();
+		}
+	}
+	grid.invalidateStats();
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,107 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef SCENARIOS_H
+#define SCENARIOS_H
+
+#include <vector>
+#include "grid.h"
+
+/** Maximum number of scenarios simulated together */
+#define MAX_SCENARIOS 8
+
+/** This class simulates the drainage of several initial water depths (scenarios) over
+the same terrain in a single pass. Z is stored once and read once per neighbourhood for
+all the scenarios. W and DA are stored as 4 or 8 lanes per cell (the number of scenarios
+rounded up), so that the transfers of all the scenarios are computed with SIMD. The transfer
+rule is the one of Grid::fastWaterTransfer, applied to each lane independently. The FIFO is
+shared by all of them: each entry holds a cell and the lanes it is queued for, and a lane only
+joins the last entry, so every lane processes its cells in the same order as a separate run */
+class ScenarioGrid {
+
+public:
+	/** Constructor */
+	ScenarioGrid();
+
+	/** Destructor */
+	~ScenarioGrid();
+
+	/** Prepares the scenarios over the terrain of the grid. The initial W of scenario k is the
+	W of the grid plus initW[k]. At most MAX_SCENARIOS scenarios are supported */
+	void setup(Grid &grid, const std::vector<HEIGHT> &initW);
+
+	/** Computes an iteration of the algorithm for the running scenarios.
+	\param transfer Returns the water transferred in this iteration by each scenario */
+	void waterTransfer(HEIGHT *transfer);
+
+	/** Stops a scenario: its W and DA values are no longer updated */
+	inline void stopScenario(int k) { running[k] = false; }
+
+	/** Returns whether a scenario is running */
+	inline bool isRunning(int k) { return running[k]; }
+
+	/** Gets the number of cells queued for the next iteration of a scenario */
+	inline size_t getNumQueuedCells(int k) { return numQueuedCells[k]; }
+
+	/** Gets the number of scenarios */
+	inline int getNumScenarios() { return numScenarios; }
+
+	/** Copies the W and DA values of a scenario to the cells of the grid and clears their result marks */
+	void exportScenario(int k, Grid &grid);
+
+private:
+	/** Grid dimentions */
+	unsigned dimX, dimY;
+	/** Number of scenarios and of lanes per cell */
+	int numScenarios, numLanes;
+	/** Altitude of each cell */
+	HEIGHT *Z;
+	/** W and DA of each cell, numLanes lanes per cell */
+	HEIGHT *W, *DA;
+	/** Scenarios still running */
+	bool running[MAX_SCENARIOS];
+	/** FIFO of unprocessed cells: position in the planes and mask of the queued lanes */
+	CircQueue<size_t, LargeAllocator<size_t> > processingCells;
+	/** Cells queued for each scenario */
+	size_t numQueuedCells[MAX_SCENARIOS];
+	/** Border cells */
+	std::vector<unsigned char> borderCells;
+	/** Offsets of the 8 neighbours of a cell */
+	ptrdiff_t neighbourOffsets[8];
+	/** Slope factors of the 8 neighbours */
+	HEIGHT neighbourWeights[8];
+
+	/** Finds the steepest descent neighbour of an interior cell in every lane (0-7, in the
+	order of neighbourOffsets) and the altitude plus water of that neighbour */
+	template<int LANES> void findLowerNeighbours(size_t i, int *lowerNeighbour, HEIGHT *lowerZW);
+
+	/** Queues a cell for some lanes, joining the last entry of the FIFO if it is the same cell */
+	void queueLanes(size_t i, unsigned lanes);
+
+	/** Processes the FIFO once with LANES lanes per cell.
+	\param accum Returns the water transferred by each lane */
+	template<int LANES> void transferLanes(HEIGHT *accum);
+
+	/** Frees the planes */
+	void release();
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include <cstring>
+#include <climits>
+#include <stdexcept>
+#include <algorithm>
+#include <zlib.h>
+
+#include "snapshot.h"
+#include "trace.h"
+
+using namespace std;
+
+//-----------------------------------------------------------------
+
+static inline void writeUInt(ofstream &ofs, unsigned value)
+{
+	ofs.write((const char *)&value, sizeof(value));
+}
+
+/** Bits of a float, which are delta encoded and compressed without loss */
+static inline unsigned floatBits(HEIGHT value)
+{
+	unsigned bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+//-----------------------------------------------------------------
+
+SnapshotWriter::SnapshotWriter(const char *filename, unsigned dimX, unsigned dimY, int planes, int interval) :
+	dimX(dimX), dimY(dimY), planes(planes), interval(max(interval, 1)), freeFrames(SNAPSHOT_BUFFERS),
+	filledFrames(SNAPSHOT_BUFFERS), numFrames(0), numDropped(0), lastCaptured(UINT_MAX), bytes(0), captureSeconds(0.0), finished(false)
+{
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.open(filename, ofstream::binary);
+
+	// Header
+	ofs.write("DSNP", 4);
+	writeUInt(ofs, 1);
+	writeUInt(ofs, dimX);
+	writeUInt(ofs, dimY);
+	writeUInt(ofs, planes);
+	bytes = 20;
+
+	int numPlanes = ((planes & SNAPSHOT_W) ? 1 : 0) + ((planes & SNAPSHOT_DA) ? 1 : 0);
+	for (int i = 0; i < SNAPSHOT_BUFFERS; ++i) {
+		frames[i].data.resize((size_t)dimX * dimY * numPlanes);
+		freeFrames.push(&frames[i]);
+	}
+
+	writer = thread(&SnapshotWriter::writeFrames, this);
+}
+
+//-----------------------------------------------------------------
+
+SnapshotWriter::~SnapshotWriter()
+{
+	try {
+		finish();
+	} catch(std::exception &) {
+	}
+}
+
+//-----------------------------------------------------------------
+
+void SnapshotWriter::capture(Grid &grid, unsigned iteration, bool last)
+{
+	if (last ? iteration == lastCaptured : iteration % interval != 0)
+		return;
+
+	double start = getSeconds();
+	Frame *frame = 0;
+
+	// The last snapshot waits for a free buffer; the others never stall the simulation
+	if (last)
+		freeFrames.pop(frame);
+	else if (!freeFrames.tryPop(frame)) {
+		++numDropped;
+		return;
+	}
+
+	size_t planeSize = (size_t)dimX * dimY;
+	unsigned *W = (planes & SNAPSHOT_W) ? &frame->data[0] : 0;
+	unsigned *DA = (planes & SNAPSHOT_DA) ? &frame->data[W ? planeSize : 0] : 0;
+	frame->iteration = iteration;
+
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t r = 0; r < (ptrdiff_t)dimY; ++r) {
+		size_t i = (size_t)r * dimX;
+		Cell *row = grid.getCell(0, (unsigned)r);
+		if (W)
+			for (unsigned int c = 0; c < dimX; ++c)
+				W[i + c] = floatBits(row[c].getW());
+		if (DA)
+			for (unsigned int c = 0; c < dimX; ++c)
+				DA[i + c] = floatBits(row[c].getDA());
+	}
+
+	filledFrames.push(frame);
+	lastCaptured = iteration;
+	captureSeconds += getSeconds() - start;
+}
+
+//-----------------------------------------------------------------
+
+void SnapshotWriter::finish()
+{
+	if (finished)
+		return;
+	finished = true;
+
+	filledFrames.close();
+	writer.join();
+	if (error.empty())
+		ofs.close();
+	if (!error.empty())
+		throw runtime_error(error);
+}
+
+//-----------------------------------------------------------------
+
+void SnapshotWriter::writeFrames()
+{
+	size_t frameSize = frames[0].data.size();
+	size_t blockSize = (size_t)SNAPSHOT_BLOCK_ROWS * dimX;
+	size_t numBlocks = (frameSize + blockSize - 1) / blockSize;
+	uLong blockBound = compressBound((uLong)(blockSize * sizeof(unsigned)));
+	vector<unsigned> previous(frameSize, 0);
+	vector<unsigned char> shuffled(frameSize * sizeof(unsigned));
+	vector<Bytef> compressed(numBlocks * blockBound);
+	vector<unsigned> compressedSizes(numBlocks);
+	Frame *frame = 0;
+	Trace::nameThread("snapshot writer");
+
+	while (filledFrames.pop(frame)) {
+		if (error.empty()) {
+			try {
+				TraceSpan span("encode frame");
+				bool keyFrame = (numFrames % SNAPSHOT_KEY_INTERVAL) == 0;
+				bool failed = false;
+
+				// Blocks are encoded in parallel, as the simulation thread is mostly serial
+				#pragma omp parallel for schedule(dynamic)
+				for (ptrdiff_t b = 0; b < (ptrdiff_t)numBlocks; ++b) {
+					size_t begin = b * blockSize, end = min(begin + blockSize, frameSize), n = end - begin;
+					unsigned char *planeBytes = &shuffled[begin * sizeof(unsigned)];
+					for (size_t i = 0; i < n; ++i) {
+						unsigned delta = keyFrame ? frame->data[begin + i] : frame->data[begin + i] ^ previous[begin + i];
+						planeBytes[i] = (unsigned char)delta;
+						planeBytes[n + i] = (unsigned char)(delta >> 8);
+						planeBytes[2 * n + i] = (unsigned char)(delta >> 16);
+						planeBytes[3 * n + i] = (unsigned char)(delta >> 24);
+					}
+
+					uLongf size = blockBound;
+					if (compress2(&compressed[b * blockBound], &size, planeBytes, (uLong)(n * sizeof(unsigned)), Z_BEST_SPEED) != Z_OK)
+						failed = true;
+					compressedSizes[b] = (unsigned)size;
+				}
+				if (failed)
+					throw runtime_error("error compressing snapshot");
+
+				// The captured values are the reference of the next frame
+				previous.swap(frame->data);
+
+				writeUInt(ofs, frame->iteration);
+				writeUInt(ofs, keyFrame ? 1 : 0);
+				writeUInt(ofs, (unsigned)numBlocks);
+				ofs.write((const char *)&compressedSizes[0], numBlocks * sizeof(unsigned));
+				bytes += (3 + numBlocks) * sizeof(unsigned);
+				for (size_t b = 0; b < numBlocks; ++b) {
+					ofs.write((const char *)&compressed[b * blockBound], compressedSizes[b]);
+					bytes += compressedSizes[b];
+				}
+				++numFrames;
+			} catch(std::exception &e) {
+				error = string("error writing snapshots: ") + e.what();
+			}
+		}
+		freeFrames.push(frame);
+	}
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,113 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <thread>
+
+#include "grid.h"
+#include "boundedqueue.h"
+
+/** Planes stored in the snapshots */
+#define SNAPSHOT_W 1
+#define SNAPSHOT_DA 2
+
+/** Number of frames captured while the previous ones are being written */
+#define SNAPSHOT_BUFFERS 2
+/** A key frame (not delta encoded) is stored every this many frames */
+#define SNAPSHOT_KEY_INTERVAL 16
+/** Rows of a plane compressed as an independent block */
+#define SNAPSHOT_BLOCK_ROWS 64
+
+/** This class writes a time series of the W and/or DA planes of a grid without stalling the
+simulation. capture() copies the planes into a free buffer and returns; a background thread
+encodes the frames and writes them to a .dsnp stream.
+
+Stream layout (little endian): "DSNP", version, dimX, dimY and planes (uint32). Each frame is
+the iteration, the flags (1 = key frame), the number of blocks and the compressed size of each
+block (uint32), followed by the blocks. The raw frame is the selected planes (W first) in raster
+order as 32 bit floats. Except in key frames, each value is XORed with the same value of the
+previous frame. The result is split in blocks of SNAPSHOT_BLOCK_ROWS rows; the bytes of each block are
+grouped by significance (the lowest byte of every value first) and deflated with zlib */
+class SnapshotWriter {
+
+public:
+	/** Opens the stream and starts the writer thread.
+	\param planes Combination of SNAPSHOT_W and SNAPSHOT_DA
+	\param interval Iterations between two snapshots */
+	SnapshotWriter(const char *filename, unsigned dimX, unsigned dimY, int planes, int interval);
+
+	/** Destructor. Finishes the stream if finish() was not called */
+	~SnapshotWriter();
+
+	/** Copies the planes of the grid if the iteration is a multiple of the interval. If the writer
+	is still busy with the previous SNAPSHOT_BUFFERS frames, the snapshot is dropped.
+	\param last Captures the final state: waits for a free buffer and ignores the interval,
+	unless this iteration was already captured */
+	void capture(Grid &grid, unsigned iteration, bool last = false);
+
+	/** Writes the pending frames and closes the stream. Throws the error of the writer thread, if any */
+	void finish();
+
+	/** Gets the number of frames written */
+	inline unsigned getNumFrames() { return numFrames; }
+
+	/** Gets the number of snapshots dropped because the writer was busy */
+	inline unsigned getNumDropped() { return numDropped; }
+
+	/** Gets the size of the stream */
+	inline unsigned long long getBytes() { return bytes; }
+
+	/** Gets the time spent by capture() in the simulation thread */
+	inline double getCaptureSeconds() { return captureSeconds; }
+
+private:
+	/** Snapshot waiting to be written */
+	struct Frame {
+		unsigned iteration;
+		/** Bits of the floats of the planes */
+		std::vector<unsigned> data;
+	};
+
+	unsigned dimX, dimY;
+	int planes, interval;
+	std::ofstream ofs;
+	/** Frames and queues between the simulation and the writer thread */
+	Frame frames[SNAPSHOT_BUFFERS];
+	BoundedQueue<Frame *> freeFrames, filledFrames;
+	std::thread writer;
+	/** Error of the writer thread */
+	std::string error;
+	unsigned numFrames, numDropped, lastCaptured;
+	unsigned long long bytes;
+	double captureSeconds;
+	bool finished;
+
+	/** Body of the writer thread */
+	void writeFrames();
+};
+
+#endif
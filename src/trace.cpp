@@ -0,0 +1,319 @@
+#include <fstream>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <iomanip>
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+#ifdef __linux__
+	#include <unistd.h>
+	#include <sys/syscall.h>
+	#include <linux/perf_event.h>
+#endif
+
+#include "trace.h"
+#include "memory.h"
+
+using namespace std;
+
+/** Maximum number of threads measured by the performance counters */
+#define PERF_MAX_THREADS 256
+
+namespace {
+
+/** Span of the trace */
+struct Span {
+	const char *name;
+	int thread;
+	double start, end;
+};
+
+/** Events of a phase of the performance counters report */
+struct Phase {
+	double seconds;
+	unsigned long long events[PERF_EVENTS];
+	unsigned long long cells;
+	unsigned count;
+};
+
+/** State of the trace */
+mutex traceMutex;
+bool traceEnabled = false;
+string traceFile;
+double traceStart;
+vector<Span> spans;
+vector< pair<int, string> > threadNames;
+atomic<int> numThreads(0);
+
+/** State of the performance counters: a descriptor per event and measured thread */
+bool perfEnabled = false;
+int perfDescriptors[PERF_MAX_THREADS][PERF_EVENTS];
+int perfThreads = 0;
+bool perfAvailable[PERF_EVENTS];
+vector<string> phaseNames;
+map<string, Phase> phases;
+
+/** Gets the number of the calling thread in the trace */
+int getThread()
+{
+	static thread_local int thread = -1;
+	if (thread < 0)
+		thread = numThreads++;
+	return thread;
+}
+
+#ifdef __linux__
+/** Opens a counter of the calling thread */
+int openCounter(unsigned type, unsigned long long config)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+}
+
+//-----------------------------------------------------------------
+
+void Trace::enable(const string &filename)
+{
+	lock_guard<mutex> guard(traceMutex);
+	traceEnabled = true;
+	traceFile = filename;
+	traceStart = getSeconds();
+	getThread();
+}
+
+//-----------------------------------------------------------------
+
+bool Trace::isEnabled()
+{
+	return traceEnabled;
+}
+
+//-----------------------------------------------------------------
+
+void Trace::nameThread(const char *name)
+{
+	// Threads keep their first name, as the calling thread may also run the work of a worker
+	static thread_local bool named = false;
+	if (!traceEnabled || named)
+		return;
+	named = true;
+	int thread = getThread();
+	lock_guard<mutex> guard(traceMutex);
+	threadNames.push_back(make_pair(thread, string(name)));
+}
+
+//-----------------------------------------------------------------
+
+void Trace::addSpan(const char *name, double start, double end)
+{
+	Span span;
+	span.name = name;
+	span.thread = getThread();
+	span.start = start;
+	span.end = end;
+	lock_guard<mutex> guard(traceMutex);
+	spans.push_back(span);
+}
+
+//-----------------------------------------------------------------
+
+void Trace::save()
+{
+	if (!traceEnabled)
+		return;
+	lock_guard<mutex> guard(traceMutex);
+
+	ofstream ofs;
+	ofs.exceptions(ofstream::failbit | ofstream::badbit);
+	ofs.open(traceFile.c_str());
+	ofs << fixed << setprecision(3);
+	ofs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << endl;
+	ofs << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"drainage\"}}";
+	for (size_t i = 0; i < threadNames.size(); ++i)
+		ofs << "," << endl << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << threadNames[i].first
+			<< ", \"args\": {\"name\": \"" << threadNames[i].second << "\"}}";
+	// Complete events, in microseconds from the start of the trace
+	for (size_t i = 0; i < spans.size(); ++i)
+		ofs << "," << endl << "{\"name\": \"" << spans[i].name << "\", \"cat\": \"drainage\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+			<< spans[i].thread << ", \"ts\": " << (spans[i].start - traceStart) * 1e6 << ", \"dur\": "
+			<< (spans[i].end - spans[i].start) * 1e6 << "}";
+	ofs << endl << "]}" << endl;
+}
+
+//-----------------------------------------------------------------
+
+bool PerfCounters::enable(string &error)
+{
+#ifdef __linux__
+	const unsigned types[PERF_EVENTS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+	const unsigned long long configs[PERF_EVENTS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+
+	// Each OpenMP thread (the calling thread is the first one) opens its own counters
+	int failure = 0;
+	perfThreads = 1;
+	#pragma omp parallel
+	{
+		int thread = 0;
+		#ifdef _OPENMP
+			thread = omp_get_thread_num();
+			#pragma omp critical
+			perfThreads = max(perfThreads, min(omp_get_num_threads(), PERF_MAX_THREADS));
+		#endif
+		if (thread < PERF_MAX_THREADS) {
+			for (int e = 0; e < PERF_EVENTS; ++e) {
+				perfDescriptors[thread][e] = openCounter(types[e], configs[e]);
+				if (perfDescriptors[thread][e] < 0) {
+					#pragma omp critical
+					failure = errno;
+				}
+			}
+		}
+	}
+
+	// An event missing in any thread (not every CPU counts all of them) is not reported
+	int numAvailable = 0;
+	for (int e = 0; e < PERF_EVENTS; ++e) {
+		perfAvailable[e] = true;
+		for (int t = 0; t < perfThreads; ++t)
+			perfAvailable[e] = perfAvailable[e] && perfDescriptors[t][e] >= 0;
+		for (int t = 0; t < perfThreads && !perfAvailable[e]; ++t) {
+			if (perfDescriptors[t][e] >= 0)
+				close(perfDescriptors[t][e]);
+			perfDescriptors[t][e] = -1;
+		}
+		numAvailable += perfAvailable[e] ? 1 : 0;
+	}
+
+	if (!numAvailable) {
+		error = strerror(failure);
+		return false;
+	}
+	perfEnabled = true;
+	return true;
+#else
+	error = "only supported on Linux";
+	return false;
+#endif
+}
+
+//-----------------------------------------------------------------
+
+bool PerfCounters::isEnabled()
+{
+	return perfEnabled;
+}
+
+//-----------------------------------------------------------------
+
+void PerfCounters::read(unsigned long long *values)
+{
+	for (int e = 0; e < PERF_EVENTS; ++e)
+		values[e] = 0;
+#ifdef __linux__
+	for (int t = 0; t < perfThreads; ++t) {
+		for (int e = 0; e < PERF_EVENTS; ++e) {
+			unsigned long long value = 0;
+			if (perfAvailable[e] && ::read(perfDescriptors[t][e], &value, sizeof(value)) == (ssize_t)sizeof(value))
+				values[e] += value;
+		}
+	}
+#endif
+}
+
+//-----------------------------------------------------------------
+
+void PerfCounters::addPhase(const char *name, double seconds, const unsigned long long *events, unsigned long long cells)
+{
+	lock_guard<mutex> guard(traceMutex);
+	if (phases.find(name) == phases.end()) {
+		phaseNames.push_back(name);
+		Phase &phase = phases[name];
+		memset(&phase, 0, sizeof(phase));
+	}
+	Phase &phase = phases[name];
+	phase.seconds += seconds;
+	for (int e = 0; e < PERF_EVENTS; ++e)
+		phase.events[e] += events[e];
+	phase.cells += cells;
+	++phase.count;
+}
+
+//-----------------------------------------------------------------
+
+void PerfCounters::report(ostream &os)
+{
+	if (!perfEnabled)
+		return;
+	lock_guard<mutex> guard(traceMutex);
+
+	const char *eventNames[PERF_EVENTS] = { "cycles", "instructions", "LLC misses", "branch misses", "dTLB misses" };
+	os << "Performance counters (" << perfThreads << " threads):" << endl;
+	for (size_t i = 0; i < phaseNames.size(); ++i) {
+		const Phase &phase = phases[phaseNames[i]];
+		const unsigned long long *events = phase.events;
+		os << "  " << phaseNames[i] << ": " << phase.seconds * 1000.0 << " ms";
+		for (int e = 0; e < PERF_EVENTS; ++e) {
+			os << ", " << eventNames[e] << " ";
+			if (perfAvailable[e])
+				os << events[e];
+			else
+				os << "n/a";
+		}
+		if (perfAvailable[PERF_CYCLES] && perfAvailable[PERF_INSTRUCTIONS] && events[PERF_CYCLES])
+			os << ", IPC " << (double)events[PERF_INSTRUCTIONS] / events[PERF_CYCLES];
+		if (phase.cells) {
+			os << ", " << phase.cells << " cells";
+			if (perfAvailable[PERF_CYCLES] && events[PERF_CYCLES])
+				os << " (" << (double)phase.cells / events[PERF_CYCLES] << " per cycle)";
+		}
+		os << endl;
+	}
+}
+
+//-----------------------------------------------------------------
+
+TraceSpan::TraceSpan(const char *name, bool counted) :
+	name(name), start(0.0), counted(counted && perfEnabled), cells(0)
+{
+	if (!traceEnabled && !this->counted)
+		return;
+	if (this->counted)
+		PerfCounters::read(events);
+	start = getSeconds();
+}
+
+//-----------------------------------------------------------------
+
+TraceSpan::~TraceSpan()
+{
+	if (!traceEnabled && !counted)
+		return;
+	double end = getSeconds();
+	if (traceEnabled)
+		Trace::addSpan(name, start, end);
+	if (counted) {
+		unsigned long long endEvents[PERF_EVENTS];
+		PerfCounters::read(endEvents);
+		for (int e = 0; e < PERF_EVENTS; ++e)
+			endEvents[e] -= events[e];
+		PerfCounters::addPhase(name, end - start, endEvents, cells);
+	}
+}
+
+//-----------------------------------------------------------------
@@ -0,0 +1,105 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Antonio Rueda and Jose M. Noguera               *
+ *   ajrueda@ujaen.es, jnoguera@ujaen.es                                   *
+ *   University of Jaen (Spain)                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <iostream>
+
+/** Hardware events measured by the performance counters */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_BRANCH_MISSES 3
+#define PERF_DTLB_MISSES 4
+#define PERF_EVENTS 5
+
+/** This class records the spans of the program phases and of the work of each thread, and saves
+them as Chrome trace events (JSON), which chrome://tracing and Perfetto display as a timeline.
+Nothing is recorded unless the trace is enabled */
+class Trace {
+
+public:
+	/** Starts recording. The trace is saved to filename by save() */
+	static void enable(const std::string &filename);
+
+	/** Returns whether the spans are being recorded */
+	static bool isEnabled();
+
+	/** Names the calling thread in the trace, unless it already has a name */
+	static void nameThread(const char *name);
+
+	/** Records a span of the calling thread (times as returned by getSeconds) */
+	static void addSpan(const char *name, double start, double end);
+
+	/** Saves the recorded spans */
+	static void save();
+};
+
+/** This class reads the hardware performance counters (Linux perf_event_open) of the calling thread
+and of the OpenMP threads around the program phases, and reports the events of each phase together
+with the cells processed per cycle. Nothing is measured unless the counters are enabled */
+class PerfCounters {
+
+public:
+	/** Opens the counters. Returns false, with the reason in error, if they are not available */
+	static bool enable(std::string &error);
+
+	/** Returns whether the counters are open */
+	static bool isEnabled();
+
+	/** Reads the sum of each event over the measured threads */
+	static void read(unsigned long long *values);
+
+	/** Adds the events and the cells of a phase to the report */
+	static void addPhase(const char *name, double seconds, const unsigned long long *events, unsigned long long cells);
+
+	/** Prints the events of each phase */
+	static void report(std::ostream &os);
+};
+
+/** Span of a phase or of the work of a thread: starts when it is constructed and is recorded when it
+is destroyed */
+class TraceSpan {
+
+public:
+	/** Starts the span.
+	\param counted The span is also a phase of the performance counters report */
+	TraceSpan(const char *name, bool counted = false);
+
+	/** Ends the span */
+	~TraceSpan();
+
+	/** Adds cells to the number of cells processed during the span */
+	inline void addCells(unsigned long long n) { cells += n; }
+
+private:
+	const char *name;
+	double start;
+	bool counted;
+	unsigned long long cells;
+	unsigned long long events[PERF_EVENTS];
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+
+#include "grid.h"
+#include "exact.h"
+
+using namespace std;
+
+/** Water dropped on each cell */
+#define TEST_WATER 0.05f
+
+static int numFailures = 0;
+
+//-----------------------------------------------------------------
+
+static void check(bool condition, const string &message)
+{
+	if (!condition) {
+		cout << "FAILED: " << message << endl;
+		++numFailures;
+	}
+}
+
+//-----------------------------------------------------------------
+
+/** Checks that the water dropped on the land cells reaches the border cells, or the sinks given */
+static void checkBalance(Grid &grid, const string &name, double sinkWater = 0.0)
+{
+	double dropped = 0.0, drained = 0.0;
+	for (unsigned y = 0; y < grid.getDimY(); ++y) {
+		for (unsigned x = 0; x < grid.getDimX(); ++x) {
+			Cell *cell = grid.getCell(x, y);
+			if (cell->getZ() <= 0.0f)
+				continue;
+			dropped += TEST_WATER;
+			if (x == 0 || y == 0 || x == grid.getDimX() - 1 || y == grid.getDimY() - 1)
+				drained += cell->getDA() + TEST_WATER;
+		}
+	}
+	check(fabs(drained + sinkWater - dropped) <= 1e-4 * dropped, name + ": water balance");
+}
+
+//-----------------------------------------------------------------
+
+/** A pit next to a cell slightly higher than it, within the flat tolerance: the cell must drain into
+the pit, not receive its water back */
+static void testPit()
+{
+	Grid grid(5, 5);
+	for (unsigned y = 0; y < 5; ++y)
+		for (unsigned x = 0; x < 5; ++x)
+			grid.getCell(x, y)->setZ(200.0f);
+	grid.getCell(2, 2)->setZ(100.0f);
+	grid.getCell(1, 1)->setZ(100.005f);
+	grid.setW(0.0f);
+	grid.setDA(0.0f);
+
+	ExactAccumulation exact;
+	exact.run(grid, TEST_WATER);
+	check(exact.getNumSinks() == 1, "pit: one sink");
+	check(fabs(grid.getCell(2, 2)->getDA() - 8 * TEST_WATER) < 1e-5f, "pit: the 8 interior cells drain into the pit");
+	checkBalance(grid, "pit", grid.getCell(2, 2)->getDA() + TEST_WATER);
+}
+
+//-----------------------------------------------------------------
+
+/** Random terrain filled as with -f: all the water reaches the border */
+static void testFilledTerrain(unsigned seed)
+{
+	const unsigned dim = 60;
+	string file = "exact_test.hgt";
+	{
+		ofstream ofs(file.c_str(), ofstream::binary);
+		srand(seed);
+		for (unsigned i = 0; i < dim * dim; ++i) {
+			int z = 1 + rand() % 300;
+			ofs.put((char)(z >> 8));
+			ofs.put((char)(z & 0xff));
+		}
+	}
+	Grid grid;
+	grid.loadHGT(file.c_str(), dim, dim, 90, 90);
+	remove(file.c_str());
+	// Fractions of a meter, so that the filled flats are level only within the tolerance
+	for (unsigned y = 0; y < dim; ++y)
+		for (unsigned x = 0; x < dim; ++x)
+			grid.getCell(x, y)->setZ(grid.getCell(x, y)->getZ() + (rand() % 1000) / 1000.0f);
+
+	grid.setW(10000.0f);
+	while (grid.dry() > 1)
+		;
+	grid.setDA(0.0f);
+
+	ExactAccumulation exact;
+	exact.run(grid, TEST_WATER);
+	char name[32];
+	sprintf(name, "terrain %u", seed);
+	check(exact.getNumSinks() == 0, string(name) + ": no sinks");
+	checkBalance(grid, name);
+}
+
+//-----------------------------------------------------------------
+
+int main()
+{
+	testPit();
+	for (unsigned seed = 1; seed <= 5; ++seed)
+		testFilledTerrain(seed);
+
+	if (numFailures)
+		cout << numFailures << " checks failed" << endl;
+	else
+		cout << "All checks passed" << endl;
+	return numFailures ? 1 : 0;
+}
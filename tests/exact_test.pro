@@ -0,0 +1,20 @@
+# ----------------------------------------------------
+# Water balance checks of the exact drainage engine.
+# Build with qmake and run ./release/exact_test
+# ------------------------------------------------------
+
+TEMPLATE = app
+TARGET = exact_test
+DESTDIR = ./release
+QT += core gui
+CONFIG += release console c++11 thread
+DEFINES += _CONSOLE
+INCLUDEPATH += ../src
+OBJECTS_DIR += release
+QMAKE_CXXFLAGS += -fopenmp
+QMAKE_LFLAGS += -fopenmp
+LIBS += -lz
+unix:LIBS += -lrt
+include(../win32/drainage_flood.pri)
+SOURCES -= ../src/main.cpp
+SOURCES += exact_test.cpp
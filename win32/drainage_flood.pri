@@ -7,9 +7,42 @@
 message("You are running qmake on a generated .pro file. This may not work!")
 
 
-HEADERS += ../src/cell.h \
+HEADERS += ../src/async.h \
+    ../src/basins.h \
+    ../src/boundedqueue.h \
+    ../src/cell.h \
     ../src/circqueue.h \
-    ../src/grid.h
-SOURCES += ../src/cell.cpp \
+    ../src/colortable.h \
+    ../src/domain.h \
+    ../src/exact.h \
+    ../src/flowindex.h \
+    ../src/grid.h \
+    ../src/hgtreader.h \
+    ../src/memory.h \
+    ../src/network.h \
+    ../src/pipeline.h \
+    ../src/pyramid.h \
+    ../src/raster.h \
+    ../src/roi.h \
+    ../src/scenarios.h \
+    ../src/snapshot.h \
+    ../src/trace.h
+SOURCES += ../src/async.cpp \
+    ../src/basins.cpp \
+    ../src/cell.cpp \
+    ../src/colortable.cpp \
+    ../src/domain.cpp \
+    ../src/exact.cpp \
+    ../src/flowindex.cpp \
     ../src/grid.cpp \
-    ../src/main.cpp
+    ../src/hgtreader.cpp \
+    ../src/main.cpp \
+    ../src/memory.cpp \
+    ../src/network.cpp \
+    ../src/pipeline.cpp \
+    ../src/pyramid.cpp \
+    ../src/raster.cpp \
+    ../src/roi.cpp \
+    ../src/scenarios.cpp \
+    ../src/snapshot.cpp \
+    ../src/trace.cpp
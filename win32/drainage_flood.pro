@@ -6,7 +6,7 @@ TEMPLATE = app
 TARGET = drainage_flood
 DESTDIR = ./release
 QT += core gui multimedia
-CONFIG += release console
+CONFIG += release console c++11 thread
 DEFINES += _CONSOLE QT_LARGEFILE_SUPPORT QT_DLL QT_HAVE_MMX QT_HAVE_3DNOW QT_HAVE_SSE QT_HAVE_MMXEXT QT_HAVE_SSE2 QT_MULTIMEDIA_LIB
 INCLUDEPATH += ./release \
     $(QTDIR)/mkspecs/default
@@ -14,5 +14,9 @@ DEPENDPATH += .
 MOC_DIR += ./GeneratedFiles/release
 OBJECTS_DIR += release
 UI_DIR += ./GeneratedFiles
+QMAKE_CXXFLAGS += -fopenmp
+QMAKE_LFLAGS += -fopenmp
+LIBS += -lz
+unix:LIBS += -lrt
 RCC_DIR += ./GeneratedFiles
 include(drainage_flood.pri)